@@ -0,0 +1,189 @@
+/*
+ Calcuclock cycle counts
+
+ The emulator's checks (emulator/checks.h) give host timings, which are good for before-and-after comparisons but
+ say little about the ATmega. This runs on the ATmega328P itself - in simavr, or on the real thing - and times the
+ same functions in CPU cycles with timer 1, printing them over serial at 9600 baud.
+
+  make cycles        build build/cycles.elf and run it in simavr
+  make cycles-flash  or program it into a Calcuclock, and watch the serial port
+
+ The calendar functions are called with a spread of inputs across 2000-2099, and the display formatters with the
+ numbers from emulator/display.golden (those in a float's range) and each message. Each call is timed on its own.
+ Timer 1 counts every cycle, or every 64th for calls too long for 16 bits (dateIsValid, which prints - the text is
+ sent a byte at a time, waiting for each, so it dominates). The cost of timing a call is taken off. It's built
+ with the same flags as the firmware, so the compiler inlines what it would there, and without DEBUG_SERIAL
+ unless that's asked for, so the formatters are timed without their debug text.
+
+ */
+
+#define NO_MAIN
+#include "../source.c"
+
+//Inputs for the function being timed, and somewhere for its result, so that it isn't optimised away.
+static DateTime benchDate;
+static uint32_t benchEpoch;
+static volatile long benchSink;
+
+typedef void (*BenchFn)();
+
+static uint16_t benchOverhead = 0;
+
+//Cycles taken by one call of f, less the cost of timing it. ~0 if it took too long to time at all.
+static uint32_t benchCycles(BenchFn f) {
+
+	TCCR1B = _BV(CS10);
+	TCNT1 = 0;
+	TIFR1 = _BV(TOV1);
+	f();
+	uint16_t t = TCNT1;
+	if(!bit_is_set(TIFR1, TOV1))
+		return (t > benchOverhead) ? (t - benchOverhead) : 0;
+
+	//Again, at clk/64.
+	TCCR1B = _BV(CS11) | _BV(CS10);
+	TCNT1 = 0;
+	TIFR1 = _BV(TOV1);
+	f();
+	t = TCNT1;
+	TCCR1B = _BV(CS10);
+	return bit_is_set(TIFR1, TOV1) ? ~0UL : (uint32_t) t * 64;
+
+}
+
+static void benchNothing() {
+}
+
+//Set benchDate to sample i of n, spread over the century (and through the day, for the hours).
+static void benchDateSample(uint16_t i, uint16_t n) {
+	const uint32_t start = 946684800UL;	//1/1/2000
+	const uint32_t century = 3155760000UL;	//To 1/1/2100
+	benchEpoch = start + (century / n) * i + (i % 24) * 3600UL;
+	dateFromEpoch(benchEpoch, &benchDate);
+	benchDate.timezone = inBst(benchDate.year, benchDate.month, benchDate.day) ? 1 : 0;
+}
+
+//Time f over n samples of benchDate, and print the mean and worst.
+static void benchDates(const char *name, BenchFn f, uint16_t n) {
+
+	uint32_t total = 0;
+	uint32_t worst = 0;
+	for(uint16_t i=0;i<n;i++) {
+		benchDateSample(i, n);
+		rtcCommit(&benchDate);
+		calculateTimezoneCorrection();	//For displayDate and displayTime
+		uint32_t c = benchCycles(f);
+		total += c;
+		if(c > worst)
+			worst = c;
+	}
+
+	Serial.flush();
+	printf("  %-28s %5u calls %9lu cycles mean %9lu worst %7lu us mean\n", name, n, total / n, worst, total / n / (F_CPU / 1000000UL));
+
+}
+
+//Display formatter inputs. avr-libc's printf has no floating point or 64-bit support, so each carries its own label.
+struct BenchNumber {
+	const char *label;
+	int64_t i;
+	double d;
+};
+
+static const BenchNumber benchNumbers[] = {
+	{"0", 0, 0},
+	{"1", 1, 1},
+	{"-1", -1, -1},
+	{"42", 42, 42},
+	{"999999", 999999, 999999},
+	{"1000000", 1000000, 1000000},
+	{"-100000", -100000, -100000},
+	{"1234567", 1234567, 1234567},
+	{"12345678901", 12345678901LL, 12345678901.0},
+	{"-9223372036854775807", -9223372036854775807LL, -9.223372e18},
+	{"0.5", 0, 0.5},
+	{"3.14159", 3, 3.14159},
+	{"-3.14159", -3, -3.14159},
+	{"0.001", 0, 0.001},
+	{"0.00012345", 0, 0.00012345},
+	{"1e-10", 0, 1e-10},
+	{"99999.5", 99999, 99999.5},
+	{"1234567.8", 1234567, 1234567.8},
+	{"-123456.7", -123456, -123456.7},
+	{"6.02e23", 0, 6.02e23},
+	{"0.3333333", 0, 0.3333333},
+	{"2.9999999", 2, 2.9999999},
+	{"12.345678", 12, 12.345678},
+	{"99999.99", 99999, 99999.99},
+	{"999999.7", 999999, 999999.7},
+};
+#define BENCH_NUMBERS (sizeof(benchNumbers) / sizeof(benchNumbers[0]))
+
+static const BenchNumber *benchNumber;
+
+//Time f once for each of benchNumbers, printing each, and the mean.
+static void benchFormat(const char *name, BenchFn f) {
+
+	uint32_t total = 0;
+	printf("  %s\n", name);
+	for(uint8_t i=0;i<BENCH_NUMBERS;i++) {
+		benchNumber = &benchNumbers[i];
+		uint32_t c = benchCycles(f);
+		total += c;
+		Serial.flush();
+		printf("    %-22s %9lu cycles %7lu us\n", benchNumber->label, c, c / (F_CPU / 1000000UL));
+	}
+	printf("    %-22s %9lu cycles %7lu us\n", "mean", total / BENCH_NUMBERS, total / BENCH_NUMBERS / (F_CPU / 1000000UL));
+
+}
+
+int main() {
+
+	halInit();
+	Serial.begin(SERIAL_BAUD);
+	fdev_setup_stream(&uartout, uart_putchar, NULL, _FDEV_SETUP_WRITE);
+	stdout = &uartout;
+
+	//Nothing else is running - no display, no RTC, and interrupts off throughout.
+	cli();
+	TCCR1A = 0;
+	TIMSK1 = 0;
+	benchOverhead = benchCycles(benchNothing);
+
+	printf("cycles: calendar (at %lu MHz, %u cycles taken off each for timing)\n", F_CPU / 1000000UL, benchOverhead);
+	benchDates("dayOfWeek", [] { benchSink = dayOfWeek(benchDate.year, benchDate.month, benchDate.day); }, 256);
+	benchDates("leapYear", [] { benchSink = leapYear(benchDate.year); }, 256);
+	benchDates("daysInMonth", [] { benchSink = daysInMonth(benchDate.year, benchDate.month); }, 256);
+	benchDates("dateIsValid (prints)", [] { benchSink = dateIsValid(benchDate.year, benchDate.month, benchDate.day); }, 32);
+	benchDates("dateExists", [] { benchSink = dateExists(benchDate.year, benchDate.month, benchDate.day); }, 256);
+	benchDates("inBst", [] { benchSink = inBst(benchDate.year, benchDate.month, benchDate.day); }, 256);
+	benchDates("calculateTimezoneCorrection", [] { calculateTimezoneCorrection(); }, 256);
+	benchDates("epochFromDate", [] { benchSink = epochFromDate(&benchDate); }, 256);
+	benchDates("dateFromEpoch", [] { DateTime t; dateFromEpoch(benchEpoch, &t); benchSink = t.day; }, 256);
+	benchDates("rtcChecksum", [] { benchSink = rtcChecksum(); }, 256);
+
+	printf("cycles: display\n");
+	benchFormat("displayInt64", [] { displayInt64(benchNumber->i); });
+	benchFormat("displayDouble", [] { displayDouble(benchNumber->d); });
+	benchFormat("displayBest (the calculator's answer, as an integer and a float)", [] { displayBest(benchNumber->i, benchNumber->d); });
+	benchDates("displayDate", [] { displayDate(); }, 256);
+	benchDates("displayTime", [] { displayTime(); }, 256);
+	uint32_t worst = 0;
+	for(uint8_t m=0;m<=MSG_DIAG;m++) {
+		benchSink = m;
+		uint32_t c = benchCycles([] { displayMessage(benchSink); });
+		if(c > worst)
+			worst = c;
+	}
+	printf("  %-28s %5u calls %9lu cycles worst\n", "displayMessage", MSG_DIAG + 1, worst);
+
+	printf("cycles: done\n");
+	Serial.flush();
+
+	//simavr stops when the CPU sleeps with interrupts off.
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_enable();
+	sleep_cpu();
+	for(;;);
+
+}
@@ -0,0 +1,85 @@
+/*
+ Emulator stand-in for the Arduino core
+
+ Just what hal.h expects the core to provide. Pin writes only matter for the LED, which the emulator
+ shows, and serial output goes to the emulator's log (and its pseudo-terminal, if it has one, which is
+ where serial input comes from too).
+
+ */
+
+#ifndef EMU_ARDUINO_H
+#define EMU_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+#undef abs
+#define abs(x) ((x)>0?(x):-(x))
+
+void emuDigitalWrite(uint8_t pin, uint8_t value);
+void emuSerialWrite(const char *s, size_t n);
+int emuSerialAvailable();
+int emuSerialRead();
+
+static inline void pinMode(uint8_t pin, uint8_t mode) {}
+static inline void digitalWrite(uint8_t pin, uint8_t value) { emuDigitalWrite(pin, value); }
+
+struct EmuSerial {
+	//Sending takes no time, so the last byte has always gone (TXC0).
+	void begin(unsigned long baud) { UCSR0A |= _BV(TXC0); }
+	void write(char c) { emuSerialWrite(&c, 1); }
+	void print(const char *s) { emuSerialWrite(s, strlen(s)); }
+	void print(long n) { char s[16]; snprintf(s, sizeof(s), "%ld", n); print(s); }
+	void print(int n) { print((long) n); }
+	void print(double d) {
+		//As the Arduino core does (and hal.h).
+		if(isinf(d))
+			print("inf");
+		else if((d > 4294967040.0) || (d < -4294967040.0))
+			print("ovf");
+		else {
+			char s[32];
+			snprintf(s, sizeof(s), "%.2f", d);
+			print(s);
+		}
+	}
+	void println(const char *s) { print(s); println(); }
+	void println() { print("\r\n"); }
+	void flush() {}
+	int available() { return emuSerialAvailable(); }
+	int read() { return emuSerialRead(); }
+};
+
+static EmuSerial Serial;
+
+//The firmware points stdout at the UART. Give it one of its own, and send its printf to the log too.
+int emuPrintf(const char *format, ...);
+static FILE *emuFirmwareStdout;
+#undef stdout
+#define stdout emuFirmwareStdout
+#define printf emuPrintf
+#define _FDEV_SETUP_WRITE 2
+#define fdev_setup_stream(stream, put, get, rwflag) do {} while(0)
+
+#endif
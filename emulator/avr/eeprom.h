@@ -0,0 +1,20 @@
+/*
+ Emulator stand-in for <avr/eeprom.h>. EEMEM variables are ordinary host memory, which lasts as long
+ as the emulator does.
+
+ */
+
+#ifndef EMU_AVR_EEPROM_H
+#define EMU_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+
+static inline void eeprom_read_block(void *dst, const void *src, size_t n) { memcpy(dst, src, n); }
+static inline void eeprom_update_block(const void *src, void *dst, size_t n) { memcpy(dst, src, n); }
+static inline uint8_t eeprom_read_byte(const uint8_t *p) { return *p; }
+static inline void eeprom_update_byte(uint8_t *p, uint8_t value) { *p = value; }
+
+#endif
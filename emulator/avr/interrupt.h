@@ -0,0 +1,21 @@
+/*
+ Emulator stand-in for <avr/interrupt.h>
+
+ Interrupts are only ever delivered from inside sleep_mode, between the firmware's own statements,
+ so turning them off and on again doesn't need to do anything.
+
+ */
+
+#ifndef EMU_AVR_INTERRUPT_H
+#define EMU_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+static inline void sei() {}
+static inline void cli() {}
+
+//Handlers are plain functions, which the emulator calls by name.
+#define SIGNAL(vector) void vector(void)
+#define ISR(vector, ...) void vector(void)
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ Emulator stand-in for <avr/io.h>
+
+ The ATmega328P registers the firmware uses, as plain variables. The emulator looks at them to decide which
+ timers and interrupts are running, and fills in the ones the hardware would (TCNT2, ADC).
+
+ */
+
+#ifndef EMU_AVR_IO_H
+#define EMU_AVR_IO_H
+
+#include <stdint.h>
+
+#define EMU_REG8(name) static volatile uint8_t name
+#define EMU_REG16(name) static volatile uint16_t name
+
+EMU_REG8(TCCR0A); EMU_REG8(TCCR0B); EMU_REG8(TCNT0); EMU_REG8(TIMSK0);
+EMU_REG8(TCCR1A); EMU_REG8(TCCR1B); EMU_REG8(TIMSK1); EMU_REG16(OCR1A); EMU_REG16(OCR1B);
+EMU_REG8(TCCR2A); EMU_REG8(TCCR2B); EMU_REG8(ASSR); EMU_REG8(TIMSK2); EMU_REG8(OCR2A); EMU_REG8(OCR2B);
+EMU_REG8(EICRA); EMU_REG8(EIMSK); EMU_REG8(EIFR);
+EMU_REG8(ADMUX); EMU_REG8(ADCSRA); EMU_REG8(ADCSRB); EMU_REG16(ADC); EMU_REG8(ACSR); EMU_REG8(DIDR0); EMU_REG8(DIDR1);
+EMU_REG8(PORTB); EMU_REG8(PORTC); EMU_REG8(PORTD); EMU_REG8(DDRB); EMU_REG8(DDRC); EMU_REG8(DDRD);
+EMU_REG8(PINB); EMU_REG8(PINC); EMU_REG8(PIND);
+EMU_REG8(UCSR0A); EMU_REG8(UCSR0B); EMU_REG8(UCSR0C); EMU_REG8(UDR0); EMU_REG16(UBRR0);
+EMU_REG8(CLKPR); EMU_REG8(OSCCAL); EMU_REG8(MCUSR); EMU_REG8(SMCR); EMU_REG8(PRR); EMU_REG8(SREG);
+
+//The ATmega328P's 2KB of RAM. The firmware's variables and stack are the host's, though.
+#define RAMSTART 0x100
+#define RAMEND 0x8FF
+
+//Timer 2 is clocked by the 32.768kHz crystal, so it follows simulated time. Each read takes a little of it,
+//so that the firmware can busy-wait on it.
+uint8_t emuTcnt2();
+#define TCNT2 emuTcnt2()
+
+//TOV2 is set from when timer 2 overflows until its interrupt is taken.
+uint8_t emuTifr2();
+#define TIFR2 emuTifr2()
+
+//Timer 1 counts CPU cycles from whatever it was loaded with, so it follows simulated time too (at the CPU clock
+//when it was loaded). TOV1 in TIFR1 is set once it has overflowed, and cleared by writing a 1, as on the chip.
+struct EmuTcnt1 {
+	operator uint16_t() const;
+	EmuTcnt1 &operator=(uint16_t value);
+	EmuTcnt1 &operator+=(uint16_t value) { return *this = (uint16_t) (*this + value); }
+};
+struct EmuTifr1 {
+	operator uint8_t() const;
+	EmuTifr1 &operator=(uint8_t value);
+};
+static EmuTcnt1 TCNT1;
+static EmuTifr1 TIFR1;
+
+enum { CS00 = 0, CS01, CS02 };
+enum { CS10 = 0, CS11, CS12 };
+enum { TOIE1 = 0, OCIE1A, OCIE1B };
+enum { TOV1 = 0, OCF1A, OCF1B };
+enum { CS20 = 0, CS21, CS22 };
+enum { TOIE2 = 0, OCIE2A, OCIE2B };
+enum { TOV2 = 0, OCF2A, OCF2B };
+enum { TCR2BUB = 0, TCR2AUB, OCR2BUB, OCR2AUB, TCN2UB, AS2, EXCLK };
+enum { ISC00 = 0, ISC01, ISC10, ISC11 };
+enum { INT0 = 0, INT1 };
+enum { MUX0 = 0, MUX1, MUX2, MUX3, ADLAR = 5, REFS0, REFS1 };
+enum { ADPS0 = 0, ADPS1, ADPS2, ADIE, ADIF, ADATE, ADSC, ADEN };
+enum { ACD = 7 };
+enum { AIN0D = 0, AIN1D };
+enum { MPCM0 = 0, U2X0, UPE0, DOR0, FE0, UDRE0, TXC0, RXC0 };
+enum { TXB80 = 0, RXB80, UCSZ02, TXEN0, RXEN0, UDRIE0, TXCIE0, RXCIE0 };
+enum { UCPOL0 = 0, UCSZ00, UCSZ01 };
+enum { CLKPS0 = 0, CLKPS1, CLKPS2, CLKPS3, CLKPCE = 7 };
+enum { PORF = 0, EXTRF, BORF, WDRF };
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+#endif
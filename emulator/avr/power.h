@@ -0,0 +1,20 @@
+/*
+ Emulator stand-in for <avr/power.h>. Whether a timer or the ADC is running is decided from its
+ own registers, so there's nothing to do here.
+
+ */
+
+#ifndef EMU_AVR_POWER_H
+#define EMU_AVR_POWER_H
+
+#define EMU_POWER(name) static inline void power_##name##_enable() {} static inline void power_##name##_disable() {}
+
+EMU_POWER(adc)
+EMU_POWER(spi)
+EMU_POWER(twi)
+EMU_POWER(usart0)
+EMU_POWER(timer0)
+EMU_POWER(timer1)
+EMU_POWER(timer2)
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ Emulator stand-in for <avr/sleep.h>
+
+ sleep_mode is where simulated time passes - see emulator.cpp.
+
+ */
+
+#ifndef EMU_AVR_SLEEP_H
+#define EMU_AVR_SLEEP_H
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_ADC 1
+#define SLEEP_MODE_PWR_DOWN 2
+#define SLEEP_MODE_PWR_SAVE 3
+
+extern uint8_t emuSleepMode;
+
+static inline void set_sleep_mode(uint8_t mode) { emuSleepMode = mode; }
+static inline void sleep_enable() {}
+static inline void sleep_disable() {}
+void sleep_mode();
+
+#endif
@@ -0,0 +1,714 @@
+/*
+ Emulator self-checks
+
+ Run with emulator -c <name>, these put parts of the firmware through far more cases than could be tried by
+ hand, checking them against the host's C library where it can give the right answer. Each prints what it
+ checked and anything that was wrong, and the emulator exits with a failure status if anything was.
+
+  calendar   every date from 2000 to 2099, and every hour around each BST change
+  rtc        a century of RTC interrupts, one after another (this takes about half a minute)
+  display    the display formatters, against the segment patterns in display.golden
+  keypad     the keypad decoding and debouncing, with key presses made up of ADC readings (see checkKeypad)
+
+ Timings are host nanoseconds per call - useful for comparing before and after a change, but not a measure
+ of how long the ATmega takes. For that, make cycles times the same functions in AVR cycles (see bench/cycles.cpp).
+
+ */
+
+#ifndef EMU_CHECKS_H
+#define EMU_CHECKS_H
+
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+static uint32_t checkFailures = 0;
+
+//Report a failure, but don't flood the output if there are lots of them.
+static void checkFail(const char *format, ...) {
+	if(++checkFailures <= 20) {
+		va_list args;
+		va_start(args, format);
+		printf("  FAIL: ");
+		vprintf(format, args);
+		printf("\n");
+		va_end(args);
+	}
+	else if(checkFailures == 21)
+		printf("  (and more)\n");
+}
+
+static uint64_t checkClock() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void checkTiming(const char *name, uint64_t ns, uint32_t calls) {
+	printf("  %-40s %9u calls %9.1f ns/call\n", name, calls, (double) ns / calls);
+}
+
+//The reference: the host's calendar, in seconds since 1970 (GMT).
+static time_t checkTime(int y, int m, int d, int h) {
+	struct tm t = {};
+	t.tm_year = y - 1900;
+	t.tm_mon = m - 1;
+	t.tm_mday = d;
+	t.tm_hour = h;
+	return timegm(&t);
+}
+
+//01:00 GMT on the last Sunday of the month, when BST starts (March) or ends (October).
+static time_t checkBstChange(int y, int m) {
+	time_t t = checkTime(y, m, 31, 1);
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	return t - tm.tm_wday * 86400;
+}
+
+//Is the UK on BST at this moment?
+static boolean checkInBst(time_t t) {
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	int y = tm.tm_year + 1900;
+	return (t >= checkBstChange(y, 3)) && (t < checkBstChange(y, 10));
+}
+
+static int tmDay(time_t t) { struct tm tm; gmtime_r(&t, &tm); return tm.tm_mday; }
+static int tmMonth(time_t t) { struct tm tm; gmtime_r(&t, &tm); return tm.tm_mon + 1; }
+static int tmYear(time_t t) { struct tm tm; gmtime_r(&t, &tm); return tm.tm_year + 1900; }
+
+//Set the RTC to a moment, and let the calendar catch up as it would.
+static void checkSetRtc(time_t t, uint8_t tz) {
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	DateTime dt = {(uint8_t) tm.tm_hour, (uint8_t) tm.tm_min, (uint8_t) tm.tm_sec,
+			(uint8_t) tm.tm_mday, (uint8_t) (tm.tm_mon + 1), tm.tm_year + 1900, tz};
+	rtcCommit(&dt);
+}
+
+static void checkCalendar() {
+
+	printf("calendar: every day from 2000 to 2099\n");
+
+	uint32_t days = 0;
+	time_t start = checkTime(2000, 1, 1, 12);
+	time_t end = checkTime(2100, 1, 1, 12);
+
+	for(time_t t = start; t < end; t += 86400) {
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		int y = tm.tm_year + 1900, m = tm.tm_mon + 1, d = tm.tm_mday;
+
+		//Tomorrow's month tells us whether this is the last day of the month.
+		time_t next = t + 86400;
+		struct tm tn;
+		gmtime_r(&next, &tn);
+		boolean lastDay = (tn.tm_mon != tm.tm_mon);
+
+		if(dayOfWeek(y, m, d) != tm.tm_wday)
+			checkFail("dayOfWeek(%d, %d, %d) = %d, should be %d", y, m, d, dayOfWeek(y, m, d), tm.tm_wday);
+
+		if(!dateIsValid(y, m, d) || !dateExists(y, m, d))
+			checkFail("dateIsValid or dateExists(%d, %d, %d) is false", y, m, d);
+
+		if(lastDay) {
+			if(daysInMonth(y, m) != d)
+				checkFail("daysInMonth(%d, %d) = %d, should be %d", y, m, daysInMonth(y, m), d);
+			if(dateIsValid(y, m, d + 1) || dateExists(y, m, d + 1))
+				checkFail("dateIsValid or dateExists(%d, %d, %d) is true", y, m, d + 1);
+			if((m == 2) && (leapYear(y) != (d == 29)))
+				checkFail("leapYear(%d) is %d", y, leapYear(y));
+		}
+
+		//inBst works by the day, so ask about midday.
+		if(inBst(y, m, d) != checkInBst(t))
+			checkFail("inBst(%d, %d, %d) is %d", y, m, d, inBst(y, m, d));
+
+		days++;
+	}
+
+	//A few that can never be right.
+	static const int bad[][3] = {{2014, 0, 1}, {2014, 13, 1}, {2014, 1, 0}, {1999, 12, 31}, {2100, 1, 1}, {2014, 2, 29}};
+	for(uint8_t i=0;i<sizeof(bad)/sizeof(bad[0]);i++)
+		if(dateIsValid(bad[i][0], bad[i][1], bad[i][2]) || dateExists(bad[i][0], bad[i][1], bad[i][2]))
+			checkFail("dateIsValid or dateExists(%d, %d, %d) is true", bad[i][0], bad[i][1], bad[i][2]);
+
+	printf("  %u days\n", days);
+
+	//Every hour of the days either side of each change: the RTC should switch timezone at 01:00 GMT,
+	//and the local time shown should always be right.
+	printf("calendar: every hour around each BST change\n");
+	uint32_t hoursChecked = 0;
+	for(int y = 2000; y < 2100; y++) {
+		for(uint8_t change = 0; change < 2; change++) {
+			time_t at = checkBstChange(y, change ? 10 : 3);
+			time_t t = at - 2 * 86400;
+			checkSetRtc(t, checkInBst(t));
+			for(; t < at + 2 * 86400; t += 3600) {
+				//Tick through the last second of the hour before, as the RTC interrupt would.
+				checkSetRtc(t - 1, firmwareTimezone);
+				TIMER2_OVF_vect();
+				calculateTimezoneCorrection();
+
+				if(firmwareTimezone != checkInBst(t))
+					checkFail("timezone is %d at %02d:00 %02d/%02d/%04d GMT", firmwareTimezone,
+							(int) (t / 3600 % 24), (int) tmDay(t), (int) tmMonth(t), (int) tmYear(t));
+
+				time_t local = t + (checkInBst(t) ? 3600 : 0);
+				struct tm tl;
+				gmtime_r(&local, &tl);
+				if((tzc_hours != tl.tm_hour) || (tzc_day != tl.tm_mday) || (tzc_month != tl.tm_mon + 1) || (tzc_year != tl.tm_year + 1900))
+					checkFail("local time %02u:00 %02u/%02u/%04d, should be %02d:00 %02d/%02d/%04d",
+							tzc_hours, tzc_day, tzc_month, tzc_year, tl.tm_hour, tl.tm_mday, tl.tm_mon + 1, tl.tm_year + 1900);
+				hoursChecked++;
+			}
+		}
+	}
+	printf("  %u hours\n", hoursChecked);
+
+	//How long each takes, over the whole century.
+	printf("calendar: timings\n");
+	volatile int sink = 0;
+	uint64_t ns;
+	uint32_t calls;
+
+	#define CHECK_TIME_DAYS(name, expr) \
+		calls = 0; \
+		ns = checkClock(); \
+		for(int y = 2000; y < 2100; y++) \
+			for(int m = 1; m <= 12; m++) \
+				for(int d = 1; d <= 28; d++, calls++) \
+					sink += (expr); \
+		checkTiming(name, checkClock() - ns, calls);
+
+	CHECK_TIME_DAYS("dayOfWeek", dayOfWeek(y, m, d));
+	CHECK_TIME_DAYS("leapYear", leapYear(y));
+	CHECK_TIME_DAYS("daysInMonth", daysInMonth(y, m));
+	CHECK_TIME_DAYS("dateIsValid", dateIsValid(y, m, d));
+	CHECK_TIME_DAYS("inBst", inBst(y, m, d));
+	#undef CHECK_TIME_DAYS
+
+	calls = 0;
+	ns = checkClock();
+	for(time_t t = start; t < end; t += 86400 + 3600, calls++) {
+		checkSetRtc(t, 1);
+		calculateTimezoneCorrection();
+	}
+	checkTiming("rtcCommit + calculateTimezoneCorrection", checkClock() - ns, calls);
+
+}
+
+//Run the RTC interrupt (and the calendar work it asks rtcService for) once for every second from 2000 to 2099,
+//as fast as it will go. At the end of each hour, compare the time, date and timezone with the right answer.
+static void checkRtc() {
+
+	printf("rtc: every second from 2000 to 2099\n");
+
+	time_t t = checkTime(2000, 1, 1, 0);
+	time_t end = checkTime(2100, 1, 1, 0);
+	checkSetRtc(t, checkInBst(t));
+
+	uint64_t ticks = 0, tickNs = 0;
+	uint64_t hourNs = 0, hourWorst = 0;
+	uint32_t hoursChecked = 0, tzChanges = 0;
+	int64_t worstDrift = 0;
+	uint8_t lastTz = firmwareTimezone;
+
+	while(t < end) {
+
+		//The ordinary ticks, which only count seconds and minutes, timed together.
+		uint64_t ns = checkClock();
+		for(uint16_t i=0;i<3599;i++)
+			TIMER2_OVF_vect();
+		tickNs += checkClock() - ns;
+		ticks += 3599;
+
+		//The tick that ends the hour, and the calendar work it leaves for rtcService, timed on their own.
+		ns = checkClock();
+		TIMER2_OVF_vect();
+		if(rtcCalendarPending)
+			rtcService();
+		ns = checkClock() - ns;
+		hourNs += ns;
+		if(ns > hourWorst)
+			hourWorst = ns;
+
+		t += 3600;
+		hoursChecked++;
+
+		struct tm should;
+		gmtime_r(&t, &should);
+		struct tm is = {};
+		is.tm_year = year - 1900;
+		is.tm_mon = month - 1;
+		is.tm_mday = day;
+		is.tm_hour = hours;
+		is.tm_min = minutes;
+		is.tm_sec = seconds;
+		int64_t drift = (int64_t) timegm(&is) - t;
+
+		if(drift || (hours != should.tm_hour) || (day != should.tm_mday) || (month != should.tm_mon + 1) || (year != should.tm_year + 1900)) {
+			checkFail("%02u:%02u:%02u %02u/%02u/%04d, should be %02d:00:00 %02d/%02d/%04d GMT", hours, minutes, seconds, day, month, year,
+					should.tm_hour, should.tm_mday, should.tm_mon + 1, should.tm_year + 1900);
+			if(llabs(drift) > llabs(worstDrift))
+				worstDrift = drift;
+			//Carry on from the right time, so one mistake isn't reported for the rest of the century.
+			checkSetRtc(t, checkInBst(t));
+		}
+
+		if(firmwareTimezone != checkInBst(t)) {
+			checkFail("timezone is %d at %02d:00 %02d/%02d/%04d GMT", firmwareTimezone, should.tm_hour, should.tm_mday, should.tm_mon + 1, should.tm_year + 1900);
+			checkSetRtc(t, checkInBst(t));
+		}
+
+		if(firmwareTimezone != lastTz)
+			tzChanges++;
+		lastTz = firmwareTimezone;
+	}
+
+	ticks += hoursChecked;
+	printf("  %llu ticks, %u hours checked, %u timezone changes, worst drift %llds\n",
+			(unsigned long long) ticks, hoursChecked, tzChanges, (long long) worstDrift);
+	printf("  ordinary tick                 %9.1f ns mean\n", (double) tickNs / (ticks - hoursChecked));
+	printf("  end of the hour + rtcService  %9.1f ns mean %9.1f ns worst\n", (double) hourNs / hoursChecked, (double) hourWorst);
+
+}
+
+//Where the expected display patterns are, relative to the top of the repository. Run the emulator from there,
+//or set this with -g. With -u, the file is written from what the firmware does now, instead of checked against
+//- after a change that's meant to alter what is shown, look over the differences before committing them.
+static const char *checkGoldenPath = "emulator/display.golden";
+static boolean checkGoldenUpdate = false;
+
+//Show something, from one line of display.golden: the function, then its arguments.
+static boolean checkRender(const char *function, const char *args) {
+
+	memset((void *) segstates, 0, 6);
+
+	if(strcmp(function, "int64") == 0)
+		displayInt64(strtoll(args, 0, 10));
+	else if(strcmp(function, "double") == 0)
+		displayDouble(strtod(args, 0));
+	else if(strcmp(function, "best") == 0) {
+		char *rest;
+		int64_t i = strtoll(args, &rest, 10);
+		displayBest(i, strtof(rest, 0));
+	}
+	else if(strcmp(function, "date") == 0) {
+		int d, m, y;
+		if(sscanf(args, "%d %d %d", &d, &m, &y) != 3)
+			return false;
+		tzc_day = d;
+		tzc_month = m;
+		tzc_year = y;
+		displayDate();
+	}
+	else if(strcmp(function, "time") == 0) {
+		int h, m, sec;
+		if(sscanf(args, "%d %d %d", &h, &m, &sec) != 3)
+			return false;
+		tzc_hours = h;
+		tzc_minutes = m;
+		tzc_seconds = sec;
+		displayTime();
+	}
+	else if(strcmp(function, "message") == 0)
+		displayMessage(atoi(args));
+	else
+		return false;
+
+	return true;
+}
+
+struct CheckGolden {
+	std::string function;
+	std::string args;
+	uint8_t expected[6];
+};
+
+//Lines are: function, arguments, then | and the six segment bytes in hex, left to right.
+static std::vector<CheckGolden> checkLoadGolden() {
+	std::vector<CheckGolden> golden;
+	FILE *f = fopen(checkGoldenPath, "r");
+	if(!f) {
+		perror(checkGoldenPath);
+		checkFailures++;
+		return golden;
+	}
+	char line[256];
+	while(fgets(line, sizeof(line), f)) {
+		if((line[0] == '#') || (line[0] == '\n'))
+			continue;
+		char *bar = strchr(line, '|');
+		char function[32];
+		int consumed = 0;
+		if(sscanf(line, "%31s %n", function, &consumed) < 1)
+			continue;
+		CheckGolden g;
+		g.function = function;
+		std::string args = bar ? std::string(line + consumed, bar - line - consumed) : std::string(line + consumed);
+		while(!args.empty() && ((args[args.size() - 1] == ' ') || (args[args.size() - 1] == '\n') || (args[args.size() - 1] == '\t')))
+			args.erase(args.size() - 1);
+		g.args = args;
+		unsigned int b[6] = {};
+		if(bar)
+			sscanf(bar + 1, "%x %x %x %x %x %x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]);
+		for(uint8_t i=0;i<6;i++)
+			g.expected[i] = b[i];
+		golden.push_back(g);
+	}
+	fclose(f);
+	return golden;
+}
+
+static void checkDisplay() {
+
+	std::vector<CheckGolden> golden = checkLoadGolden();
+	printf("display: %u patterns from %s\n", (unsigned) golden.size(), checkGoldenPath);
+
+	FILE *out = 0;
+	if(checkGoldenUpdate) {
+		//Keep the comments at the top.
+		std::string header;
+		FILE *f = fopen(checkGoldenPath, "r");
+		char line[256];
+		while(f && fgets(line, sizeof(line), f) && (line[0] == '#'))
+			header += line;
+		if(f)
+			fclose(f);
+		out = fopen(checkGoldenPath, "w");
+		if(!out) {
+			perror(checkGoldenPath);
+			checkFailures++;
+			return;
+		}
+		fputs(header.c_str(), out);
+	}
+
+	for(size_t i=0;i<golden.size();i++) {
+		CheckGolden &g = golden[i];
+		if(!checkRender(g.function.c_str(), g.args.c_str())) {
+			checkFail("can't show %s %s", g.function.c_str(), g.args.c_str());
+			continue;
+		}
+
+		if(out) {
+			char args[64];
+			snprintf(args, sizeof(args), "%s %s", g.function.c_str(), g.args.c_str());
+			fprintf(out, "%-32s| %02x %02x %02x %02x %02x %02x   %s\n", args, segstates[0], segstates[1], segstates[2],
+					segstates[3], segstates[4], segstates[5], emuDisplayText((const uint8_t *) segstates).c_str());
+		}
+		else if(memcmp((const void *) segstates, g.expected, 6) != 0)
+			checkFail("%s %s shows [%s] %02x %02x %02x %02x %02x %02x, should be [%s]", g.function.c_str(), g.args.c_str(),
+					emuDisplayText((const uint8_t *) segstates).c_str(), segstates[0], segstates[1], segstates[2],
+					segstates[3], segstates[4], segstates[5], emuDisplayText(g.expected).c_str());
+	}
+
+	if(out) {
+		fclose(out);
+		printf("  written\n");
+		return;
+	}
+
+	//How fast each function is, over all of its patterns.
+	printf("display: timings\n");
+	static const char *functions[] = {"int64", "double", "best", "date", "time", "message"};
+	for(uint8_t f=0;f<sizeof(functions)/sizeof(functions[0]);f++) {
+		uint32_t calls = 0;
+		uint64_t ns = checkClock();
+		for(uint16_t r=0;r<1000;r++)
+			for(size_t i=0;i<golden.size();i++)
+				if(golden[i].function == functions[f]) {
+					checkRender(golden[i].function.c_str(), golden[i].args.c_str());
+					calls++;
+				}
+		ns = checkClock() - ns;
+		if(calls)
+			printf("  %-8s %9u calls %9.1f ns/call %12.0f renders/s\n", functions[f], calls, (double) ns / calls, calls * 1e9 / ns);
+	}
+
+}
+
+//Keypad traces: what the two resistor ladders read from each moment on, and which key (its position in
+//emuLadder, or -1) is really being pressed. Noise and display droop are added to each reading as it's taken.
+struct CheckKeypadStep {
+	uint64_t at;	//ns from the start of the trace
+	uint16_t a, b;
+	int8_t key;
+};
+
+struct CheckKeypadTrace {
+	std::string name;
+	std::vector<CheckKeypadStep> steps;
+	uint16_t noise;		//Up to this many LSBs either way, at random
+	uint16_t droop;		//LSBs lower with all eight segments of the lit digit on (the display pulls Vcc down)
+};
+
+//A recorded trace to replay as well, set with -k. One line per change: the time in ms, the btnsA and btnsB
+//readings, then the key being pressed (as typed in the emulator) or _ for none. Lines starting with # are ignored.
+static const char *checkKeypadTracePath = 0;
+
+//How long after a key is let go it can still be reported as pressed, as the debouncing waits for a second sample.
+#define CHECK_KEYPAD_LATE 50000000ULL
+
+static uint32_t checkRandomState = 1;
+
+//xorshift - the same sequence every run, so the results only change when the firmware does.
+static uint32_t checkRandom() {
+	checkRandomState ^= checkRandomState << 13;
+	checkRandomState ^= checkRandomState >> 17;
+	checkRandomState ^= checkRandomState << 5;
+	return checkRandomState;
+}
+
+static void checkKeypadStep(CheckKeypadTrace &trace, uint64_t at, uint16_t a, uint16_t b, int8_t key) {
+	CheckKeypadStep step = {at, a, b, key};
+	trace.steps.push_back(step);
+}
+
+//Contact bounce: for bounceMs from at, the key makes and breaks contact every 0.1-0.6ms.
+static void checkKeypadBounce(CheckKeypadTrace &trace, uint64_t at, uint16_t bounceMs, uint16_t a, uint16_t b, int8_t key) {
+	uint64_t end = at + bounceMs * 1000000ULL;
+	boolean contact = true;
+	while(at < end) {
+		checkKeypadStep(trace, at, contact ? a : 1023, contact ? b : 1023, key);
+		contact = !contact;
+		at += 100000ULL + (checkRandom() % 500) * 1000ULL;
+	}
+}
+
+//A made-up trace of 200 presses of random keys, held for 60-250ms with 150-400ms between them. Every trace has
+//the same presses - only what is done to the readings differs. aged scales the ladder readings, as resistors
+//that have drifted would.
+static CheckKeypadTrace checkKeypadMake(const char *name, uint16_t bounceMs, uint16_t noise, uint16_t droop, double aged) {
+
+	CheckKeypadTrace trace;
+	trace.name = name;
+	trace.noise = noise;
+	trace.droop = droop;
+
+	checkRandomState = 2014;
+	checkKeypadStep(trace, 0, 1023, 1023, -1);
+	uint64_t t = 500000000ULL;
+	for(uint16_t i=0;i<200;i++) {
+		int8_t key = checkRandom() % 16;
+		uint64_t hold = (60 + checkRandom() % 190) * 1000000ULL;
+		uint64_t gap = (150 + checkRandom() % 250) * 1000000ULL;
+		long v = lround((key % 8) * 128 * aged);
+		if(v > 1023)
+			v = 1023;
+		uint16_t a = (key < 8) ? v : 1023;
+		uint16_t b = (key < 8) ? 1023 : v;
+
+		checkKeypadBounce(trace, t, bounceMs, a, b, key);
+		checkKeypadStep(trace, t + bounceMs * 1000000ULL, a, b, key);
+		checkKeypadBounce(trace, t + hold, bounceMs, a, b, -1);
+		checkKeypadStep(trace, t + hold + bounceMs * 1000000ULL, 1023, 1023, -1);
+		t += hold + gap;
+	}
+	checkKeypadStep(trace, t, 1023, 1023, -1);
+	return trace;
+}
+
+static boolean checkKeypadLoad(const char *path, CheckKeypadTrace &trace) {
+	FILE *f = fopen(path, "r");
+	if(!f) {
+		perror(path);
+		return false;
+	}
+	trace.name = path;
+	trace.noise = 0;
+	trace.droop = 0;
+	char line[128];
+	while(fgets(line, sizeof(line), f)) {
+		double ms;
+		unsigned a, b;
+		char key;
+		if((line[0] == '#') || (sscanf(line, "%lf %u %u %c", &ms, &a, &b, &key) != 4))
+			continue;
+		const char *p = (key == '_') ? 0 : strchr(emuLadder, key);
+		checkKeypadStep(trace, (uint64_t) (ms * 1e6), a, b, p ? (p - emuLadder) : -1);
+	}
+	fclose(f);
+	return !trace.steps.empty();
+}
+
+//The trace being replayed, for emuAdcValue.
+static const CheckKeypadTrace *checkKeypadTrace = 0;
+static size_t checkKeypadPos = 0;
+static uint64_t checkKeypadStart = 0;
+
+static uint16_t checkKeypadRead(uint8_t channel) {
+	const std::vector<CheckKeypadStep> &steps = checkKeypadTrace->steps;
+	uint64_t t = emuNow - checkKeypadStart;
+	while((checkKeypadPos + 1 < steps.size()) && (steps[checkKeypadPos + 1].at <= t))
+		checkKeypadPos++;
+
+	long v = (channel == (btnsA - A0)) ? steps[checkKeypadPos].a : steps[checkKeypadPos].b;
+	if(checkKeypadTrace->noise)
+		v += (long) (checkRandom() % (2 * checkKeypadTrace->noise + 1)) - checkKeypadTrace->noise;
+	v -= checkKeypadTrace->droop * __builtin_popcount(segstates[onDisplay]) / 8;
+	return (v < 0) ? 0 : ((v > 1023) ? 1023 : v);
+}
+
+//Replay a trace through the firmware's keypad sampling (the display and ADC interrupts) and uiWaitEvent, and
+//match the keys it reports with the presses in the trace. Returns how many were missed or wrong.
+static uint32_t checkKeypadRun(const CheckKeypadTrace &trace) {
+
+	//Where each press starts and ends.
+	struct Press { uint64_t start, end; int8_t key; boolean seen; };
+	std::vector<Press> presses;
+	for(size_t i=0;i<trace.steps.size();i++) {
+		const CheckKeypadStep &s = trace.steps[i];
+		if(!presses.empty() && (presses.back().end == UINT64_MAX) && (s.key != presses.back().key))
+			presses.back().end = s.at;
+		if((s.key >= 0) && (presses.empty() || (presses.back().end != UINT64_MAX))) {
+			Press p = {s.at, UINT64_MAX, s.key, false};
+			presses.push_back(p);
+		}
+	}
+
+	//Start in step with the display interrupt and the keypad sampling, with the noise from the beginning of its
+	//sequence, so that each trace gives the same results whichever checks ran before it.
+	checkKeypadTrace = &trace;
+	checkKeypadPos = 0;
+	if(emuNextTimer1 <= emuNow)
+		emuNextTimer1 = emuNow + emuTimer1Period();
+	checkKeypadStart = emuNextTimer1;
+	keypadTicks = 0;
+	checkRandomState = 2014;
+	emuKeypadTrace = checkKeypadRead;
+	emuEnd = emuNow + trace.steps.back().at + 1000000000ULL;
+
+	//Light every segment, for the worst droop, and start from no key.
+	for(uint8_t i=0;i<6;i++)
+		segstates[i] = 0xFF;
+	uiTimeout = 0;
+	uiTimerRunning = false;
+	uiKeyDown = uiKeyCandidate = NO_KEY;
+
+	uint32_t wrongKey = 0, extra = 0, phantom = 0;
+	uint64_t latencyTotal = 0, latencyWorst = 0;
+	try {
+		for(;;) {
+			uint8_t arg;
+			if(uiWaitEvent(&arg) != EV_KEY)
+				continue;
+
+			uint64_t t = emuNow - checkKeypadStart;
+			Press *p = 0;
+			for(size_t i=0;i<presses.size() && !p;i++)
+				if((t >= presses[i].start) && (t < presses[i].end + CHECK_KEYPAD_LATE))
+					p = &presses[i];
+
+			if(!p)
+				phantom++;
+			else if(arg != keymap[p->key])
+				wrongKey++;
+			else if(p->seen)
+				extra++;
+			else {
+				p->seen = true;
+				uint64_t latency = t - p->start;
+				latencyTotal += latency;
+				if(latency > latencyWorst)
+					latencyWorst = latency;
+			}
+		}
+	}
+	catch(EmuStop &) {
+	}
+
+	emuKeypadTrace = 0;
+	emuEnd = 0;
+
+	uint32_t seen = 0;
+	for(size_t i=0;i<presses.size();i++)
+		seen += presses[i].seen;
+	uint32_t missed = presses.size() - seen;
+
+	printf("  %-12s %4u presses %4u missed %4u wrong key %4u twice %4u phantom", trace.name.c_str(), (unsigned) presses.size(),
+			missed, wrongKey, extra, phantom);
+	if(seen)
+		printf("   latency %5.1fms mean %5.1fms worst", latencyTotal / 1e6 / seen, latencyWorst / 1e6);
+	printf("\n");
+
+	return missed + wrongKey + extra + phantom;
+}
+
+//The keypad is read once every KEY_POLL_MS, without waiting for the ladder to settle, and a key counts once
+//two readings in a row agree. Replay made-up traces with contact bounce, noise, the display pulling Vcc down,
+//and ladder resistors that have drifted, plus a recorded one if there is one, and report how many presses
+//were missed or misread and how long they took to be seen. Only the clean trace has to be right - the rest
+//are for comparing one way of reading the keypad with another.
+static void checkKeypad() {
+
+	printf("keypad: presses from ADC traces\n");
+
+	emuQuiet = true;
+
+	CheckKeypadTrace traces[] = {
+		checkKeypadMake("clean", 0, 0, 0, 1.0),
+		checkKeypadMake("bounce", 5, 0, 0, 1.0),
+		checkKeypadMake("noise", 0, 24, 0, 1.0),
+		checkKeypadMake("droop", 0, 0, 40, 1.0),
+		checkKeypadMake("aged", 0, 16, 0, 1.06),
+		checkKeypadMake("everything", 5, 24, 40, 1.06),
+	};
+
+	for(uint8_t i=0;i<sizeof(traces)/sizeof(traces[0]);i++) {
+		uint32_t wrong = checkKeypadRun(traces[i]);
+		if((i == 0) && wrong)
+			checkFail("%u presses missed or misread with a clean keypad", wrong);
+	}
+
+	if(checkKeypadTracePath) {
+		CheckKeypadTrace recorded;
+		if(checkKeypadLoad(checkKeypadTracePath, recorded))
+			checkKeypadRun(recorded);
+		else
+			checkFail("nothing to replay in %s", checkKeypadTracePath);
+	}
+
+	emuQuiet = false;
+
+}
+
+//Run the named check (or all of them), and return how many things were wrong.
+static uint32_t checkRun(const char *name) {
+
+	boolean all = (strcmp(name, "all") == 0);
+	boolean found = false;
+
+	if(all || (strcmp(name, "calendar") == 0)) {
+		checkCalendar();
+		found = true;
+	}
+
+	if(all || (strcmp(name, "rtc") == 0)) {
+		checkRtc();
+		found = true;
+	}
+
+	if(all || (strcmp(name, "display") == 0)) {
+		checkDisplay();
+		found = true;
+	}
+
+	if(all || (strcmp(name, "keypad") == 0)) {
+		checkKeypad();
+		found = true;
+	}
+
+	if(!found) {
+		printf("No check called %s\n", name);
+		return 1;
+	}
+
+	printf("%u failures\n", checkFailures);
+	return checkFailures;
+}
+
+#endif
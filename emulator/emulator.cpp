@@ -0,0 +1,746 @@
+/*
+ Calcuclock emulator
+
+ Runs the real firmware (source.c) on a Linux host. The registers are plain variables (see avr/io.h), and
+ simulated time passes whenever the firmware goes to sleep: sleep_mode moves on to the next interrupt - the
+ display timer, the RTC, an ADC conversion or a button press - and calls its handler, just as the chip would.
+ The firmware spends nearly all of its time asleep, so this runs far faster than real time.
+
+ The display is drawn as 7-segment digits in the terminal, and keys typed are pressed on the keypad:
+
+  0-9 . + - * /   the keypad
+  = or Enter      =
+  c, Esc or Backspace  C/CE/ON
+  q               quit
+
+ Input can be recorded to a script, and a script replayed instead of typing. A replay prints each change of
+ the display as a line of text, along with the time it took to appear after each key press, so that the same
+ input always gives the same output and changes in behaviour show up in a diff.
+
+ Usage: emulator [-s speed] [-r script] [-w script] [-t seconds] [-v millivolts] [-o percent] [-l logfile] [-p link]
+        emulator -c check [-u] [-g golden] [-k trace]
+
+  -s speed    simulated time runs this many times faster than real time (default 1, or as fast as possible for a replay without -p)
+  -r script   replay a script, and print the display as text
+  -w script   record the keys typed, to replay later
+  -t seconds  stop after this much simulated time (default: the end of the script plus 30s)
+  -v mV       battery voltage (default 3000)
+  -o percent  how fast the internal oscillator runs before it is calibrated (negative for slow, default 0)
+  -l logfile  write the firmware's serial output here
+  -p link     connect the serial port to a pseudo-terminal, and make link a symlink to it (for tools/serial.cpp)
+  -c check    run one of the self-checks in checks.h (or all of them), instead of the user interface
+  -g golden   the display patterns for the display check (default emulator/display.golden)
+  -u          write the display patterns from the firmware as it is now, rather than check them
+  -k trace    replay a recorded keypad trace in the keypad check, as well as the made-up ones (see checks.h)
+
+ The pseudo-terminal stands in for the serial port, so that programs on this computer can talk to the firmware
+ as they would to the real thing through a USB serial adapter. It isn't paced to the baud rate. As on the chip,
+ nothing is received in deep sleep.
+
+ Scripts have one key press per line: the time in milliseconds since the start, then the key, then (optionally)
+ how long it is held for in milliseconds (default 100). C is the C/CE/ON button. Lines starting with # are ignored.
+
+ */
+
+#define F_CPU 8000000UL
+
+#include <stdarg.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/select.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <deque>
+
+//The firmware's timezone would clash with the C library's.
+#define timezone firmwareTimezone
+
+#include "../source.c"
+
+#undef stdout
+#undef printf
+
+//Simulated time, in nanoseconds since power-up.
+static uint64_t emuNow = 0;
+static uint64_t emuEnd = 0;
+
+//When each interrupt is next due.
+static uint64_t emuNextTimer1 = 0;
+static uint64_t emuNextTimer2 = 1000000000ULL;
+static uint64_t emuAdcDone = 0;
+static boolean emuAdcBusy = false;
+
+uint8_t emuSleepMode = SLEEP_MODE_IDLE;
+
+static uint16_t emuVcc = 3000;
+
+//The internal RC oscillator: how far out it is with the factory calibration (OSCCAL at reset), in percent, and how
+//much each step of OSCCAL changes it.
+#define EMU_OSCCAL_FACTORY 0x90
+#define EMU_OSCCAL_STEP 0.004
+static double emuOscError = 0;
+static boolean emuLed = false;
+static FILE *emuLog = 0;
+
+//The serial port's pseudo-terminal (-p), and the bytes received from it that the firmware hasn't read yet.
+static int emuPty = -1;
+static int emuPtySlave = -1;
+static const char *emuPtyLink = 0;
+static std::deque<uint8_t> emuRx;
+
+//Input: key presses in order of time. The keypad is read through the resistor ladder, so a key held down
+//just changes the voltage the ADC sees.
+struct EmuInput {
+	uint64_t at;	//ns
+	uint64_t hold;	//ns
+	char key;
+};
+static std::vector<EmuInput> emuScript;
+static size_t emuScriptPos = 0;
+static int emuHeldKey = -1;			//Position of the key on the ladder (see keymap in source.c), or -1
+static uint64_t emuReleaseAt = 0;
+static FILE *emuRecord = 0;
+
+//The keys, in the order of keymap in source.c. 0-7 are on btnsA, 8-15 on btnsB.
+static const char emuLadder[] = "7410852.963=+-*/";
+
+//If set, this gives the keypad readings instead (for the keypad check, which replays ADC traces).
+static uint16_t (*emuKeypadTrace)(uint8_t channel) = 0;
+
+//Don't print or draw the display (for the checks).
+static boolean emuQuiet = false;
+
+//Interactive, or replaying a script?
+static boolean emuInteractive = true;
+static double emuSpeed = 0;
+static struct timespec emuRealStart;
+static uint64_t emuLastSync = 0;
+
+//Key-to-display latency. A key that hasn't changed the display within a second is taken to have done nothing.
+#define EMU_NO_RESPONSE 1000000000ULL
+static boolean emuAwaitingDisplay = false;
+static uint64_t emuKeyAt = 0;
+static uint32_t emuLatencyCount = 0;
+static uint64_t emuLatencyTotal = 0;
+static uint64_t emuLatencyWorst = 0;
+
+static uint8_t emuShown[6];
+
+static struct termios emuTermSaved;
+static boolean emuTermRaw = false;
+
+class EmuStop : public std::exception {};
+
+//Each read of TCNT2 takes 4 cycles at 8MHz.
+uint8_t emuTcnt2() {
+	emuNow += 500;
+	return (uint8_t) ((emuNow * 256 / 1000000000ULL) & 0xFF);
+}
+
+uint8_t emuTifr2() {
+	return (emuNow >= emuNextTimer2) ? _BV(TOV2) : 0;
+}
+
+void emuDigitalWrite(uint8_t pin, uint8_t value) {
+	if(pin == ledPin)
+		emuLed = value;
+}
+
+//If nothing is reading the pseudo-terminal, what doesn't fit in its buffer is lost, as it would be on a real serial port.
+void emuSerialWrite(const char *s, size_t n) {
+	if(emuLog)
+		fwrite(s, 1, n, emuLog);
+	if(emuPty >= 0) {
+		ssize_t sent = write(emuPty, s, n);
+		(void) sent;
+	}
+}
+
+int emuPrintf(const char *format, ...) {
+	char s[256];
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(s, sizeof(s), format, args);
+	va_end(args);
+	if(n > 0)
+		emuSerialWrite(s, ((size_t) n < sizeof(s)) ? n : sizeof(s) - 1);
+	return n;
+}
+
+int emuSerialAvailable() {
+	return emuRx.size();
+}
+
+int emuSerialRead() {
+	if(emuRx.empty())
+		return -1;
+	uint8_t c = emuRx.front();
+	emuRx.pop_front();
+	return c;
+}
+
+//The text a display digit looks most like, for the replay output.
+static char emuSegmentChar(uint8_t s) {
+	static const struct { uint8_t segments; char c; } table[] = {
+		{0x3f, '0'}, {0x06, '1'}, {0x5b, '2'}, {0x4f, '3'}, {0x66, '4'}, {0x6d, '5'}, {0x7d, '6'}, {0x07, '7'},
+		{0x7f, '8'}, {0x67, '9'}, {0x6f, '9'}, {0x00, ' '}, {0x40, '-'}, {0x77, 'A'}, {0x7c, 'b'}, {0x39, 'C'},
+		{0x5e, 'd'}, {0x79, 'E'}, {0x71, 'F'}, {0x74, 'h'}, {0x10, 'i'}, {0x38, 'L'}, {0x54, 'n'}, {0x5c, 'o'},
+		{0x50, 'r'}, {0x78, 't'}, {0x44, 'm'}, {0x58, 'c'}, {0x30, 'I'}, {0x73, 'P'}, {0x76, 'H'}, {0x3e, 'U'},
+		{0x1c, 'u'}, {0x08, '_'}, {0x01, '~'}
+	};
+	for(size_t i=0;i<sizeof(table)/sizeof(table[0]);i++)
+		if((s & 0x7f) == table[i].segments)
+			return table[i].c;
+	return '?';
+}
+
+static std::string emuDisplayText(const uint8_t *segments) {
+	std::string text;
+	for(uint8_t i=0;i<6;i++) {
+		text += emuSegmentChar(segments[i]);
+		if(segments[i] & 0x80)
+			text += '.';
+	}
+	return text;
+}
+
+//Three rows of ASCII art per digit, redrawn in place.
+static void emuDrawDisplay(const uint8_t *segments, boolean first) {
+	std::string rows[3];
+	for(uint8_t i=0;i<6;i++) {
+		uint8_t s = segments[i];
+		rows[0] += std::string(" ") + ((s & 0x01) ? "_" : " ") + "  ";
+		rows[1] += std::string((s & 0x20) ? "|" : " ") + ((s & 0x40) ? "_" : " ") + ((s & 0x02) ? "|" : " ") + " ";
+		rows[2] += std::string((s & 0x10) ? "|" : " ") + ((s & 0x08) ? "_" : " ") + ((s & 0x04) ? "|" : " ") + ((s & 0x80) ? "." : " ");
+	}
+
+	static const char *powerNames[NUM_PWR_STATES] = {"asleep", "awake", "idle"};
+	char status[80];
+	snprintf(status, sizeof(status), "%10.3fs  %-6s  %s  %02u:%02u:%02u GMT",
+			emuNow / 1e9, powerNames[powerState], emuLed ? "LED" : "   ", hours, minutes, seconds);
+
+	if(!first)
+		fputs("\033[5A", stdout);
+	printf("\r%s\033[K\n\r%s\033[K\n\r%s\033[K\n\r\033[K\n\r%s\033[K\n", rows[0].c_str(), rows[1].c_str(), rows[2].c_str(), status);
+	fflush(stdout);
+}
+
+//Look for changes to the display. It's only lit while the display timer is running.
+static void emuCheckDisplay() {
+
+	if(emuQuiet)
+		return;
+
+	uint8_t now[6];
+	boolean on = (TCCR1B & 0x07) != 0;
+	for(uint8_t i=0;i<6;i++)
+		now[i] = on ? segstates[i] : 0;
+
+	static boolean first = true;
+	boolean changed = first || (memcmp(now, emuShown, 6) != 0);
+
+	if(emuInteractive) {
+		//Redraw at least once a second for the status line.
+		static uint64_t lastDrawn = 0;
+		if(changed || (emuNow - lastDrawn) >= 1000000000ULL) {
+			emuDrawDisplay(now, first);
+			lastDrawn = emuNow;
+		}
+	}
+	else if(changed)
+		printf("%10.3f [%s]\n", emuNow / 1e9, emuDisplayText(now).c_str());
+
+	if(emuAwaitingDisplay && ((emuNow - emuKeyAt) >= EMU_NO_RESPONSE))
+		emuAwaitingDisplay = false;
+
+	//The first change after a key press is the response to it.
+	if(changed && emuAwaitingDisplay) {
+		uint64_t latency = emuNow - emuKeyAt;
+		emuAwaitingDisplay = false;
+		emuLatencyCount++;
+		emuLatencyTotal += latency;
+		if(latency > emuLatencyWorst)
+			emuLatencyWorst = latency;
+		if(!emuInteractive)
+			printf("%10s  (%.1fms)\n", "", latency / 1e6);
+	}
+
+	memcpy(emuShown, now, 6);
+	first = false;
+}
+
+static void emuPress(char key, uint64_t hold) {
+
+	if(!emuInteractive)
+		printf("%10.3f  <%c>\n", emuNow / 1e9, key);
+
+	if(emuRecord)
+		fprintf(emuRecord, "%llu %c\n", (unsigned long long) (emuNow / 1000000ULL), key);
+
+	emuKeyAt = emuNow;
+	emuAwaitingDisplay = true;
+
+	if(key == 'C') {
+		//C/CE/ON pulls INT0 low.
+		if(EIMSK & _BV(INT0))
+			INT0_vect();
+		return;
+	}
+
+	const char *p = strchr(emuLadder, key);
+	if(p) {
+		emuHeldKey = p - emuLadder;
+		emuReleaseAt = emuNow + hold;
+	}
+}
+
+//What the ADC would read now.
+static uint16_t emuAdcValue() {
+	uint8_t channel = ADMUX & 0x0F;
+	if(channel == 0x0E)
+		return (uint16_t) (1125300L / emuVcc); //The 1.1V bandgap, against Vcc
+	if(emuKeypadTrace && ((channel == (btnsA - A0)) || (channel == (btnsB - A0))))
+		return emuKeypadTrace(channel);
+	if((emuHeldKey >= 0) && (channel == (emuHeldKey / 8)))
+		return (emuHeldKey % 8) * 128;
+	return 1023;
+}
+
+//The CPU clock, from the RC oscillator and after the system clock prescaler.
+static uint64_t emuCpuHz() {
+	double osc = F_CPU * (1 + emuOscError / 100) * (1 + EMU_OSCCAL_STEP * ((int) OSCCAL - EMU_OSCCAL_FACTORY));
+	return (uint64_t) osc >> (CLKPR & 0x0F);
+}
+
+static uint16_t emuTcnt1Loaded = 0;
+static uint64_t emuTcnt1At = 0;
+static uint64_t emuTcnt1Hz = F_CPU;
+static uint64_t emuTov1ClearedAt = 0;
+static boolean emuCompADone = false;	//The compare interrupt has been taken since timer 1 was loaded
+
+static uint64_t emuTcnt1Count() {
+	return emuTcnt1Loaded + (emuNow - emuTcnt1At) * emuTcnt1Hz / 1000000000ULL;
+}
+
+EmuTcnt1::operator uint16_t() const {
+	return (uint16_t) emuTcnt1Count();
+}
+
+EmuTcnt1 &EmuTcnt1::operator=(uint16_t value) {
+	emuTcnt1Loaded = value;
+	emuTcnt1At = emuNow;
+	emuTcnt1Hz = emuCpuHz();
+	emuCompADone = false;
+	return *this;
+}
+
+EmuTifr1::operator uint8_t() const {
+	//When it last overflowed, if it has since it was loaded.
+	if(emuTcnt1Count() < 65536)
+		return 0;
+	uint64_t overflow = emuTcnt1At + (65536ULL - emuTcnt1Loaded) * 1000000000ULL / emuTcnt1Hz;
+	return (overflow > emuTov1ClearedAt) ? _BV(TOV1) : 0;
+}
+
+EmuTifr1 &EmuTifr1::operator=(uint8_t value) {
+	if(value & _BV(TOV1))
+		emuTov1ClearedAt = emuNow;
+	return *this;
+}
+
+static uint64_t emuAdcConversionTime() {
+	//13 ADC clocks, from the prescaler in ADPS2:0.
+	uint8_t ps = ADCSRA & 0x07;
+	uint16_t div = (ps < 2) ? 2 : (1 << ps);
+	return 13ULL * div * 1000000000ULL / emuCpuHz();
+}
+
+//Timer 1 overflows after counting up from what it was loaded with. (A change of clock part way through a
+//period only takes effect from the next one.)
+static uint64_t emuTimer1Period() {
+	return (65536ULL - TCNT1) * 1000000000ULL / emuCpuHz();
+}
+
+//When timer 1 reaches OCR1A, if it hasn't already this period.
+static uint64_t emuCompAAt() {
+	if(emuCompADone || (OCR1A < emuTcnt1Loaded))
+		return UINT64_MAX;
+	return emuTcnt1At + (OCR1A - emuTcnt1Loaded) * 1000000000ULL / emuTcnt1Hz;
+}
+
+static void emuPtyClose() {
+	if(emuPtyLink) {
+		unlink(emuPtyLink);
+		emuPtyLink = 0;
+	}
+}
+
+//A pseudo-terminal for the serial port, in raw mode. Keeping the slave side open ourselves means the master
+//doesn't see a hang-up each time a program that was using it closes it.
+static void emuPtyOpen(const char *link) {
+	emuPty = posix_openpt(O_RDWR | O_NOCTTY);
+	if((emuPty < 0) || grantpt(emuPty) || unlockpt(emuPty)) {
+		perror("pseudo-terminal");
+		exit(1);
+	}
+	const char *name = ptsname(emuPty);
+	emuPtySlave = open(name, O_RDWR | O_NOCTTY);
+	struct termios raw;
+	tcgetattr(emuPtySlave, &raw);
+	cfmakeraw(&raw);
+	tcsetattr(emuPtySlave, TCSANOW, &raw);
+	fcntl(emuPty, F_SETFL, O_NONBLOCK);
+
+	unlink(link);
+	if(symlink(name, link)) {
+		perror(link);
+		exit(1);
+	}
+	emuPtyLink = link;
+	atexit(emuPtyClose);
+}
+
+//Take whatever has arrived on the pseudo-terminal. The USART isn't clocked in power-save, so in deep sleep it's lost.
+static void emuReadSerial() {
+	if(emuPty < 0)
+		return;
+	uint8_t buf[64];
+	ssize_t n;
+	while((n = read(emuPty, buf, sizeof(buf))) > 0)
+		if(emuSleepMode != SLEEP_MODE_PWR_SAVE)
+			emuRx.insert(emuRx.end(), buf, buf + n);
+}
+
+static void emuTermRestore() {
+	if(emuTermRaw) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &emuTermSaved);
+		emuTermRaw = false;
+	}
+}
+
+static void emuSignal(int) {
+	emuTermRestore();
+	emuPtyClose();
+	printf("\n");
+	_exit(0);
+}
+
+static void emuTermSetup() {
+	if(!isatty(STDIN_FILENO))
+		return;
+	tcgetattr(STDIN_FILENO, &emuTermSaved);
+	struct termios raw = emuTermSaved;
+	raw.c_lflag &= ~(ICANON | ECHO);
+	raw.c_cc[VMIN] = 0;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+	emuTermRaw = true;
+	atexit(emuTermRestore);
+	signal(SIGINT, emuSignal);
+	signal(SIGTERM, emuSignal);
+}
+
+static uint64_t emuRealElapsed() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec - emuRealStart.tv_sec) * 1000000000ULL + t.tv_nsec - emuRealStart.tv_nsec;
+}
+
+//Keys typed at the terminal are pressed straight away - or, if several arrive at once (pasted, say),
+//one after another, as if typed.
+static void emuReadKeyboard() {
+	for(;;) {
+		//Don't wait - there may be nothing there.
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(STDIN_FILENO, &fds);
+		struct timeval none = {0, 0};
+		char c;
+		if((select(STDIN_FILENO + 1, &fds, 0, 0, &none) <= 0) || (read(STDIN_FILENO, &c, 1) != 1))
+			return;
+
+		if(c == 'q')
+			throw EmuStop();
+		if((c == '\n') || (c == '\r'))
+			c = '=';
+		if((c == 'c') || (c == 27) || (c == 127) || (c == 8))
+			c = 'C';
+		if((c == 'C') || strchr(emuLadder, c)) {
+			uint64_t at = (uint64_t) (emuRealElapsed() * emuSpeed);
+			if(at < emuNow)
+				at = emuNow;
+			if(!emuScript.empty() && (at < emuScript.back().at + 200000000ULL))
+				at = emuScript.back().at + 200000000ULL;
+			EmuInput in = {at, 100000000ULL, c};
+			emuScript.push_back(in);
+		}
+	}
+}
+
+//Hold simulated time back to emuSpeed times real time, reading the keyboard and the serial port while we wait.
+//A key press cuts the wait short, so returns the simulated time we've got to. This is done in 10ms steps of
+//simulated time, rather than at every interrupt.
+static uint64_t emuPace(uint64_t until) {
+	if(emuSpeed <= 0)
+		return until;
+	if((until - emuLastSync) < 10000000ULL)
+		return until;
+
+	for(;;) {
+		uint64_t real = emuRealElapsed();
+		emuReadSerial();
+		if(emuInteractive) {
+			emuReadKeyboard();
+			if((emuScriptPos < emuScript.size()) && (emuScript[emuScriptPos].at < until))
+				until = emuScript[emuScriptPos].at;
+		}
+		uint64_t due = (uint64_t) (until / emuSpeed);
+		if(real >= due) {
+			emuLastSync = until;
+			return until;
+		}
+		uint64_t wait = due - real;
+		if(wait > 10000000ULL)
+			wait = 10000000ULL;
+		struct timespec t = {0, (long) wait};
+		nanosleep(&t, 0);
+	}
+}
+
+//The CPU sleeps until the next interrupt - this is where simulated time passes. Which clocks keep running
+//depends on the sleep mode: the display timer stops in power-save and ADC noise reduction, the RTC never does.
+void sleep_mode() {
+
+	emuCheckDisplay();
+
+	if(emuEnd && (emuNow >= emuEnd))
+		throw EmuStop();
+
+	boolean timer1 = (TCCR1B & 0x07) && (TIMSK1 & _BV(TOIE1)) && (emuSleepMode == SLEEP_MODE_IDLE);
+	boolean timer2 = (TCCR2B & 0x07) && (TIMSK2 & _BV(TOIE2));
+	boolean compA = (TCCR1B & 0x07) && (TIMSK1 & _BV(OCIE1A)) && (emuSleepMode == SLEEP_MODE_IDLE);
+
+	//ADC noise reduction mode starts a conversion. One started by the firmware is picked up here too.
+	if((ADCSRA & _BV(ADEN)) && !emuAdcBusy && ((emuSleepMode == SLEEP_MODE_ADC) || (ADCSRA & _BV(ADSC)))) {
+		ADCSRA |= _BV(ADSC);
+		emuAdcBusy = true;
+		emuAdcDone = emuNow + emuAdcConversionTime();
+	}
+	boolean adc = emuAdcBusy && (emuSleepMode != SLEEP_MODE_PWR_SAVE);
+
+	uint64_t next = UINT64_MAX;
+	if(timer2)
+		next = emuNextTimer2;
+	if(timer1) {
+		if(emuNextTimer1 <= emuNow)
+			emuNextTimer1 = emuNow + emuTimer1Period();
+		if(emuNextTimer1 < next)
+			next = emuNextTimer1;
+	}
+	if(compA && (emuCompAAt() < next))
+		next = emuCompAAt();
+	if(adc && (emuAdcDone < next))
+		next = emuAdcDone;
+	if((emuHeldKey >= 0) && (emuReleaseAt < next))
+		next = emuReleaseAt;
+	if((emuScriptPos < emuScript.size()) && (emuScript[emuScriptPos].at < next))
+		next = emuScript[emuScriptPos].at;
+	if(emuEnd && (emuEnd < next))
+		next = emuEnd;
+	if(next < emuNow)
+		next = emuNow;
+	if(next == UINT64_MAX)
+		throw std::runtime_error("asleep with nothing to wake up");
+
+	emuNow = emuPace(next);
+
+	//Whatever is due. Only one interrupt is taken per sleep - the rest are still due next time.
+	if((emuHeldKey >= 0) && (emuNow >= emuReleaseAt))
+		emuHeldKey = -1;
+
+	if((emuScriptPos < emuScript.size()) && (emuNow >= emuScript[emuScriptPos].at)) {
+		EmuInput &in = emuScript[emuScriptPos++];
+		emuPress(in.key, in.hold);
+		return;
+	}
+
+	if(adc && (emuNow >= emuAdcDone)) {
+		emuAdcBusy = false;
+		ADCSRA &= ~_BV(ADSC);
+		ADC = emuAdcValue();
+		if(ADCSRA & _BV(ADIE))
+			ADC_vect();
+		return;
+	}
+
+	if(compA && (emuNow >= emuCompAAt())) {
+		emuCompADone = true;
+		TIMER1_COMPA_vect();
+		return;
+	}
+
+	if(timer2 && (emuNow >= emuNextTimer2)) {
+		emuNextTimer2 += 1000000000ULL;
+		TIMER2_OVF_vect();
+		return;
+	}
+
+	if(timer1 && (emuNow >= emuNextTimer1)) {
+		TIMER1_OVF_vect();
+		emuNextTimer1 = emuNow + emuTimer1Period();
+		return;
+	}
+
+	//Woken by the keyboard, or the end of a key press.
+}
+
+static void emuLoadScript(const char *path) {
+	FILE *f = fopen(path, "r");
+	if(!f) {
+		perror(path);
+		exit(1);
+	}
+	char line[128];
+	while(fgets(line, sizeof(line), f)) {
+		double ms, hold = 100;
+		char key;
+		if(line[0] == '#')
+			continue;
+		int n = sscanf(line, "%lf %c %lf", &ms, &key, &hold);
+		if(n < 2)
+			continue;
+		if(key == 'c')
+			key = 'C';
+		EmuInput in = {(uint64_t) (ms * 1e6), (uint64_t) (hold * 1e6), key};
+		emuScript.push_back(in);
+	}
+	fclose(f);
+}
+
+#include "checks.h"
+
+int main(int argc, char **argv) {
+
+	double endSeconds = 0;
+	const char *check = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "s:r:w:t:v:o:l:c:g:uk:p:")) != -1) {
+		switch(opt) {
+		case 'c':
+			check = optarg;
+			break;
+		case 'g':
+			checkGoldenPath = optarg;
+			break;
+		case 'u':
+			checkGoldenUpdate = true;
+			break;
+		case 'k':
+			checkKeypadTracePath = optarg;
+			break;
+		case 's':
+			emuSpeed = atof(optarg);
+			break;
+		case 'r':
+			emuLoadScript(optarg);
+			emuInteractive = false;
+			break;
+		case 'w':
+			emuRecord = fopen(optarg, "w");
+			if(!emuRecord) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			endSeconds = atof(optarg);
+			break;
+		case 'o':
+			emuOscError = atof(optarg);
+			break;
+		case 'v':
+			emuVcc = atoi(optarg);
+			break;
+		case 'l':
+			emuLog = fopen(optarg, "w");
+			if(!emuLog) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			emuPtyLink = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s speed] [-r script] [-w script] [-t seconds] [-v millivolts] [-o percent] [-l logfile] [-p link]\n", argv[0]);
+			fprintf(stderr, "       %s -c check [-u] [-g golden] [-k trace]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	OSCCAL = EMU_OSCCAL_FACTORY;
+
+	//The ADC is enabled by the Arduino core's init().
+	ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+
+	if(check) {
+		setup();
+		return checkRun(check) ? 1 : 0;
+	}
+
+	if(endSeconds > 0)
+		emuEnd = (uint64_t) (endSeconds * 1e9);
+	else if(!emuInteractive)
+		emuEnd = (emuScript.empty() ? 0 : emuScript.back().at) + 30000000000ULL;
+
+	//Whatever is on the other end of the serial port runs in real time.
+	if(emuPtyLink) {
+		emuPtyOpen(emuPtyLink);
+		if(emuSpeed <= 0)
+			emuSpeed = 1;
+	}
+
+	if(emuInteractive) {
+		if(emuSpeed <= 0)
+			emuSpeed = 1;
+		emuTermSetup();
+		printf("Keys: 0-9 . + - * / =, c for C/CE/ON, q to quit\n\n");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &emuRealStart);
+
+	try {
+		setup();
+		for(;;)
+			loop();
+	}
+	catch(EmuStop &) {
+	}
+	catch(std::exception &e) {
+		emuTermRestore();
+		fprintf(stderr, "\nStopped at %.3fs: %s\n", emuNow / 1e9, e.what());
+		return 1;
+	}
+
+	emuTermRestore();
+
+	if(emuRecord)
+		fclose(emuRecord);
+	if(emuLog)
+		fclose(emuLog);
+
+	if(!emuInteractive) {
+		printf("end %.3fs, %02u:%02u:%02u %02d/%02d/%04d GMT\n", emuNow / 1e9, hours, minutes, seconds, day, month, year);
+		if(emuLatencyCount)
+			printf("key to display: %u presses, mean %.1fms, worst %.1fms\n", emuLatencyCount,
+					emuLatencyTotal / 1e6 / emuLatencyCount, emuLatencyWorst / 1e6);
+	}
+
+	return 0;
+}
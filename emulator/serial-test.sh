@@ -0,0 +1,49 @@
+#!/bin/sh
+# Loopback test of the serial protocol. The emulator stands in for the Calcuclock, with its serial port on a
+# pseudo-terminal (emulator -p), and the client (tools/serial.cpp) talks to it there as it would to the real thing.
+#
+#  emulator/serial-test.sh [build directory]    (make serial-test builds them both first)
+
+BUILD=${1:-build}
+LINK=$BUILD/serial-test.pty
+KEYS=$BUILD/serial-test.keys
+CLIENT="$BUILD/calcuclock-serial $LINK"
+
+fail() {
+	echo "serial-test: $*"
+	exit 1
+}
+
+# Wake it up with C/CE/ON, as on the real thing.
+printf '# Wake it up\n500 C\n' > $KEYS
+$BUILD/emulator -r $KEYS -p $LINK -t 60 -l $BUILD/serial-test.log > $BUILD/serial-test.out &
+EMU=$!
+trap 'kill $EMU 2>/dev/null; rm -f $KEYS' EXIT
+
+while [ ! -e $LINK ]; do
+	sleep 0.1
+done
+sleep 1
+
+$CLIENT ping | grep -q "Protocol version 1" || fail "no reply to ping"
+
+$CLIENT settime 1700000000 0 > /dev/null || fail "settime failed"
+STATE=$($CLIENT state) || fail "no reply to state"
+EPOCH=$(echo "$STATE" | sed -n 's/.*(epoch \([0-9]*\)).*/\1/p')
+[ -n "$EPOCH" ] && [ "$EPOCH" -ge 1700000000 ] && [ "$EPOCH" -le 1700000005 ] || fail "time read back as $EPOCH"
+
+# 1970 is before the years the firmware allows, so this should be refused.
+$CLIENT settime 0 0 2> /dev/null && fail "settime accepted 1970"
+
+# In BST, auto should say so.
+$CLIENT settime 1690000000 auto > /dev/null || fail "settime auto failed"
+$CLIENT state | grep -q "BST" || fail "not BST in July"
+
+$CLIENT battery > /dev/null || fail "no reply to battery"
+$CLIENT counters | grep -q "^Mode 7:" || fail "no reply to counters"
+
+# Left alone it goes back to sleep, and stops listening.
+sleep 12
+$CLIENT ping 2> /dev/null && fail "replied while asleep"
+
+echo "serial-test: passed"
@@ -0,0 +1,227 @@
+/*
+ Calcuclock hardware abstraction
+
+ The few Arduino functions the firmware uses. When it's built with the Arduino core, these come from there.
+ Otherwise (see the Makefile) they're provided here as inline register accesses for the ATmega328P, using the
+ Arduino pin numbering, so that the core's startup code, init() and pin-mapping tables aren't needed.
+
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+
+#else
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdint.h>
+
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+
+//Analogue pins, numbered on from the digital ones as Arduino does.
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+//The calculator relies on this working for int64_t and float, which stdlib's abs doesn't.
+#undef abs
+#define abs(x) ((x)>0?(x):-(x))
+
+//Pins 0-7 are port D, 8-13 port B, and A0-A5 (14-19) port C.
+static inline volatile uint8_t *halPort(uint8_t pin) {
+	return (pin < 8) ? &PORTD : ((pin < 14) ? &PORTB : &PORTC);
+}
+
+static inline volatile uint8_t *halDdr(uint8_t pin) {
+	return (pin < 8) ? &DDRD : ((pin < 14) ? &DDRB : &DDRC);
+}
+
+static inline volatile uint8_t *halPin(uint8_t pin) {
+	return (pin < 8) ? &PIND : ((pin < 14) ? &PINB : &PINC);
+}
+
+static inline uint8_t halBit(uint8_t pin) {
+	return _BV((pin < 8) ? pin : ((pin < 14) ? (pin - 8) : (pin - 14)));
+}
+
+//Unlike Arduino, INPUT leaves the pullup alone - the firmware always sets it with digitalWrite afterwards.
+//The read-modify-write is done with interrupts off, as the display interrupt writes to the same ports.
+static inline void pinMode(uint8_t pin, uint8_t mode) {
+	uint8_t oldSREG = SREG;
+	cli();
+	if(mode == OUTPUT)
+		*halDdr(pin) |= halBit(pin);
+	else
+		*halDdr(pin) &= ~halBit(pin);
+	SREG = oldSREG;
+}
+
+static inline void digitalWrite(uint8_t pin, uint8_t value) {
+	uint8_t oldSREG = SREG;
+	cli();
+	if(value)
+		*halPort(pin) |= halBit(pin);
+	else
+		*halPort(pin) &= ~halBit(pin);
+	SREG = oldSREG;
+}
+
+static inline int digitalRead(uint8_t pin) {
+	return (*halPin(pin) & halBit(pin)) ? HIGH : LOW;
+}
+
+//A blocking conversion. The keypad and battery readings use the ADC interrupt instead, so this is only for
+//one-off readings with the ADC interrupt disabled.
+static inline int analogRead(uint8_t pin) {
+	ADMUX = _BV(REFS0) | ((pin - A0) & 0x07);
+	ADCSRA |= _BV(ADSC);
+	while(bit_is_set(ADCSRA, ADSC));
+	return ADC;
+}
+
+//Serial port. Output is polled - printing blocks until each byte has gone. Input is received by interrupt
+//(USART_RX_vect, below) into a small ring buffer, as Arduino's does, for available() and read().
+#define HAL_RX_BUFFER 32
+
+struct HalSerial {
+
+	void begin(unsigned long baud) {
+		//Double speed mode gives the smaller baud rate error at 8MHz.
+		UBRR0 = (F_CPU / 8 / baud) - 1;
+		UCSR0A = _BV(U2X0);
+		UCSR0C = _BV(UCSZ01) | _BV(UCSZ00); //8N1
+		UCSR0B = _BV(TXEN0) | _BV(RXEN0) | _BV(RXCIE0);
+	}
+
+	void write(char c) {
+		loop_until_bit_is_set(UCSR0A, UDRE0);
+		UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0); //Clear TXC0, for flush
+		UDR0 = c;
+		sent = true;
+	}
+
+	//Wait until the last byte has gone, such as before the clock (and so the baud rate) changes.
+	void flush() {
+		if(sent)
+			loop_until_bit_is_set(UCSR0A, TXC0);
+	}
+
+	boolean sent;
+
+	int available() {
+		return (uint8_t) (rxHead - rxTail) % HAL_RX_BUFFER;
+	}
+
+	//The next byte received, or -1 if there isn't one.
+	int read() {
+		if(rxHead == rxTail)
+			return -1;
+		uint8_t c = rxBuffer[rxTail];
+		rxTail = (rxTail + 1) % HAL_RX_BUFFER;
+		return c;
+	}
+
+	uint8_t rxBuffer[HAL_RX_BUFFER];
+	volatile uint8_t rxHead;	//Where the interrupt puts the next byte
+	volatile uint8_t rxTail;	//Where read takes the next one from
+
+	void print(const char *s) {
+		while(*s)
+			write(*s++);
+	}
+
+	void print(unsigned long n) {
+		char buf[3 * sizeof(unsigned long)];
+		uint8_t i = 0;
+		do {
+			buf[i++] = '0' + (n % 10);
+			n /= 10;
+		} while(n);
+		while(i)
+			write(buf[--i]);
+	}
+
+	//Negated as unsigned, so that LONG_MIN doesn't overflow.
+	void print(long n) {
+		if(n < 0) {
+			write('-');
+			print(0UL - (unsigned long) n);
+		}
+		else
+			print((unsigned long) n);
+	}
+
+	void print(int n) {
+		print((long) n);
+	}
+
+	//Two decimal places, as Arduino does - and like Arduino, "inf", or "ovf" for anything too big for the whole
+	//number part to fit an unsigned long.
+	void print(double d) {
+		if(d != d) {
+			print("nan");
+			return;
+		}
+		if((d > 4294967040.0) || (d < -4294967040.0)) {
+			print((d - d == 0) ? "ovf" : "inf");
+			return;
+		}
+		if(d < 0) {
+			write('-');
+			d = -d;
+		}
+		d += 0.005;
+		unsigned long whole = (unsigned long) d;
+		print(whole);
+		write('.');
+		uint8_t hundredths = (uint8_t) ((d - whole) * 100);
+		write('0' + hundredths / 10);
+		write('0' + hundredths % 10);
+	}
+
+	void println(const char *s) {
+		print(s);
+		println();
+	}
+
+	void println() {
+		write('\r');
+		write('\n');
+	}
+
+};
+
+static HalSerial Serial;
+
+//A byte has been received. If it was garbled (a framing error), or the buffer is full, it is lost.
+SIGNAL(USART_RX_vect) {
+	uint8_t bad = UCSR0A & _BV(FE0);
+	uint8_t c = UDR0;
+	uint8_t next = (Serial.rxHead + 1) % HAL_RX_BUFFER;
+	if(!bad && (next != Serial.rxTail)) {
+		Serial.rxBuffer[Serial.rxHead] = c;
+		Serial.rxHead = next;
+	}
+}
+
+//Set up what the Arduino core's init() would have, for the parts we use: the ADC, at 62.5kHz.
+static inline void halInit() {
+	ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+}
+
+#endif
+
+#endif
@@ -3,28 +3,43 @@
 
  TECH NOTES:
 
- Uses timer0 for delay, delayMicrosecond, as Arduino does.
- Uses timer1 as display update, approximately once or twice per millisecond.
- Uses timer2 for 32.768khz timekeeping ("real time")
- When it hasn't been pressed for a while it goes into a very deep sleep - only C/CE/ON can wake it.
+ Doesn't use timer0 (or Arduino's millis and delay) - it is left switched off.
+ Uses timer1 as display update, approximately once or twice per millisecond. This also counts milliseconds for the user interface (see timebaseMillis).
+ The CPU clock is divided down while waiting for events, and back up to 8MHz for everything else (see clockSet).
+ Uses timer2 for 32.768khz timekeeping ("real time"). TCNT2 counts 1/256ths of a second between overflows, which the stopwatch uses for sub-second timing.
+ When it hasn't been pressed for a while it goes into a very deep sleep - only C/CE/ON, the countdown timer or the alarm can wake it.
  In deep sleep, virtually nothing but the low-level timekeeping stuff is running.
+ While awake, the user interface is driven by events (see uiRun), and the CPU idles between them.
+ The time, date and calculator are kept through a reset in .noinit RAM. Settings, and the last known date, are kept in EEPROM.
+ While awake, it also answers a small framed command protocol on the serial port, for setting the time and reading diagnostics (see protoReceive).
 
  Brown-out detection is off in sleep, on when running? Or do we use the ADC to check the battery level every so often?
  WDT is to be disabled in fuses.
 
- TODO stopwatch, finish calculation (floating-point), set mode
+ TODO finish calculation (floating-point), set mode
 
  */
 
+#include "hal.h"       //pinMode, digitalWrite, Serial - from the Arduino core, or our own for the bare-metal build
 #include <avr/sleep.h>  //Needed for sleep_mode (switching the CPU into low-power mode)
 #include <avr/power.h>  //Needed for powering down peripherals such as the ADC, TWI and timers
+#include <avr/eeprom.h> //Needed for keeping the settings when the battery is changed
 #include <stdint.h>     //Needed for uint8_t
-#include <util/delay.h> //Needed for small delays, using the function _delay_us and _delay_ms
+#include <stddef.h>     //Needed for offsetof
 
 #include <stdio.h>		//Needed for FILE definitions and printf declarations (debugging)
 
 #include <math.h>		//Needed for logarithms and powers
 
+//Print diagnostic reports (such as power accounting) over the serial port at the end of each session.
+//DEBUG_SERIAL is set by the Makefile (make DEBUG_SERIAL=1, and always for the emulator) - for a debug build
+//with the Arduino IDE, define it here.
+//#define DEBUG_SERIAL
+
+//Variables in .noinit aren't cleared by the C startup code, so they keep their values through a reset
+//(the reset pin, a brownout or the watchdog) - but are random after power-up, so each group has a checksum.
+#define NOINIT __attribute__ ((section (".noinit")))
+
 //The state of each 7-segment display (A..DP for displays, left = 0, right = 5).
 volatile uint8_t segstates[6];
 
@@ -69,9 +84,27 @@ const uint8_t ledPin = 3;
 #define COLUMN_OFF HIGH
 #define COLUMN_ON LOW
 
-//preload timer with 65535 - 4000 - 4,000 cycles at 8mhz is 2khz (2,000 times per second).
-//Set this to near 0 or change prescale, to demonstrate how the display code works.
-#define PWM_TIME (65535-4000)
+//The display interrupt comes every 4,000 cycles at 8mhz - 2khz (2,000 times per second). Timer 1 is preloaded
+//with 65536 minus this, scaled to the CPU clock (see clockSet). Set it bigger to demonstrate how the display code works.
+#define DISPLAY_CYCLES 4000
+
+//The CPU clock is F_CPU divided by 2 to the power of clockDiv, with the system clock prescaler. We wait for
+//events at clockIdle, and run everything else (the arithmetic and number formatting) at clockAwake - normally
+//CLOCK_SLOW and CLOCK_FAST, but the power policy slows clockAwake down when the battery is low.
+//1MHz would leave too few cycles between display interrupts for the interrupt itself.
+#define CLOCK_FAST 0	//8MHz
+#define CLOCK_SLOW 2	//2MHz
+uint8_t clockDiv = CLOCK_FAST;
+uint8_t clockAwake = CLOCK_FAST;
+uint8_t clockIdle = CLOCK_SLOW;
+volatile uint16_t displayReload = 65536UL - DISPLAY_CYCLES;
+
+//How long each digit is lit for, out of 255 - the rest of its turn it's off, with timer 1's compare interrupt.
+//Below DISPLAY_MIN_DUTY the compare would come before the overflow interrupt has finished lighting it.
+#define DISPLAY_MIN_DUTY 16
+uint8_t displayDuty = 255;
+
+#define SERIAL_BAUD 9600
 
 enum Days {
 	Sunday = 0,
@@ -131,32 +164,360 @@ enum Messages {
 	MSG_POSINF,
 	MSG_NEGINF,
 	MSG_DATE,
-	MSG_TODO
+	MSG_TODO,
+	MSG_CLOCK,
+	MSG_TIMER,
+	MSG_ALARM,
+	MSG_DIAG
+};
+
+//The modes that can be selected by pressing C/CE/ON after waking up, in the order they are offered.
+enum Modes {
+	MODE_CLOCK = 0,
+	MODE_CHRONO,
+	MODE_TIMER,
+	MODE_CALC,
+	MODE_REMOTE,
+	MODE_SET,
+	MODE_BATT,
+	MODE_DIAG,
+	NUM_MODES
 };
 
-//Time variables - GMT - 24-hour. For example, to enter 12:05, in Summer time, you'd enter hours = 11; minutes = 5; (do NOT set to 05! 05 is processed differently to 5!)
-volatile uint8_t hours = 11;
-volatile uint8_t minutes = 5;
-volatile uint8_t seconds = 0;
+//The user interface is event-driven. Each mode is a state machine, written as a handler function that
+//is called with one event at a time (a key press, the CE button, its timer expiring...) and returns
+//straight away. Between events the CPU sits in idle sleep, woken by the display interrupt.
+//Nothing blocks, so a key press can always cut a message short.
+
+enum Events {
+	EV_ENTER = 0,	//The mode has just been entered
+	EV_KEY,			//A keypad key has been pressed - arg is the key
+	EV_CE,			//The C/CE/ON button has been pressed
+	EV_TIMER,		//The timer set with uiSetTimer has expired
+	EV_TIMEOUT,		//No buttons have been pressed for the mode's timeout
+	EV_TICK,		//The RTC has ticked over to the next second
+	EV_ALERT		//The countdown or the alarm has gone off - uiRun handles this, not the mode
+};
+
+typedef void (*UiHandler)(uint8_t event, uint8_t arg);
+
+//A consistent copy of the (GMT) time and date, taken with rtcSnapshot and written back with rtcCommit.
+//The RTC interrupt changes the time under our feet, and year is two bytes, so the fields shouldn't be read one at a time.
+typedef struct {
+	uint8_t hours;
+	uint8_t minutes;
+	uint8_t seconds;
+	uint8_t day;
+	uint8_t month;
+	int year;
+	uint8_t timezone;
+} DateTime;
+
+//Power states, for estimating where the battery charge goes.
+enum PowerStates {
+	PWR_SLEEP = 0,	//SLEEP_MODE_PWR_SAVE, only timer2 running
+	PWR_AWAKE,		//CPU running, display multiplexing
+	PWR_IDLE,		//SLEEP_MODE_IDLE between interrupts, display multiplexing
+	NUM_PWR_STATES
+};
+
+//Time variables - GMT - 24-hour.
+//These are kept through a reset, and rtcCheck is updated whenever they change. After power-up they're
+//restored from the last copy saved in EEPROM, or from settingsDefault if there isn't one.
+volatile uint8_t hours NOINIT;
+volatile uint8_t minutes NOINIT;
+volatile uint8_t seconds NOINIT;
 
 //Date variables - GMT
-volatile int year = 2014;
-volatile int month = 5;
-volatile int day = 16;
+volatile int year NOINIT;
+volatile int month NOINIT;
+volatile int day NOINIT;
+
+//Timezone - 0 is GMT, 1 is BST
+//where 1 means that the displayed time is one hour greater than GMT
+volatile uint8_t timezone NOINIT;
+
+volatile uint8_t rtcCheck NOINIT;
 
-//Timezone-corrected hours, days, months. Minutes and seconds don't change in different timezones
+//Number of whole seconds since power-up, counted by the RTC interrupt. Combined with TCNT2 this gives 1/256s resolution.
+volatile uint32_t rtcTicks = 0;
+
+//Countdown timer - the value of rtcTicks at which it goes off, if armed.
+volatile boolean countdownArmed = false;
+volatile uint32_t countdownTarget = 0;
+
+//Daily alarm, in local (timezone-corrected) time.
+volatile boolean alarmArmed = false;
+volatile uint8_t alarmHours = 7;
+volatile uint8_t alarmMinutes = 0;
+
+//Set by the RTC interrupt when the countdown or the alarm goes off. This wakes us from deep sleep.
+volatile boolean alertPending = false;
+
+//Set by the RTC interrupt every second, so that anything showing the time only redraws when it changes.
+volatile boolean rtcTicked = false;
+
+//Set by the RTC interrupt when the hour changes, so that rtcService does the calendar.
+volatile boolean rtcCalendarPending = false;
+
+//Timezone-corrected hours, days, months. Minutes and seconds don't change in different timezones,
+//but are copied from the same snapshot so that the displayed time is consistent.
 uint8_t tzc_hours = 0;
+uint8_t tzc_minutes = 0;
+uint8_t tzc_seconds = 0;
 uint8_t tzc_day = 1;
 uint8_t tzc_month = 1;
 int tzc_year = 2000;
 
-//Timezone - 0 is GMT, 1 is BST
-//where 1 means that the displayed time is one hour greater than GMT
-uint8_t timezone = 1;
+//Settings, kept in EEPROM. Each save goes into the next of SETTINGS_SLOTS slots, to spread the wear,
+//and the newest valid slot is loaded at power-up. Change SETTINGS_VERSION if the layout changes.
+#define SETTINGS_VERSION 2
+#define SETTINGS_SLOTS 8
+typedef struct {
+	uint8_t version;
+	uint8_t sequence;		//Goes up by one with each save, so that we can find the newest slot
+	uint8_t brightness;		//Display brightness, 255 is full
+	uint32_t vccReference;	//Bandgap voltage * 1023 * 1000, see readVcc
+	DateTime lastKnown;		//The time, date and timezone when last saved
+	uint8_t osccal;			//OSCCAL from the last calibration against the crystal (see oscCalibrate)
+	uint16_t osccalVcc;		//The battery voltage it was calibrated at, in mV, or 0 if it hasn't been
+	uint8_t check;
+} Settings;
+
+//For example, to enter 12:05, in Summer time, you'd enter hours = 11; minutes = 5; (do NOT set to 05! 05 is processed differently to 5!)
+const Settings settingsDefault = {SETTINGS_VERSION, 0, 255, 1125300L, {11, 5, 0, 16, 5, 2014, 1}, 0, 0, 0};
+
+Settings settingsStore[SETTINGS_SLOTS] EEMEM;
+Settings settings;
+uint8_t settingsSlot = SETTINGS_SLOTS - 1; //The slot last written to
 
 //Below this battery voltage, a warning should be displayed. 2.6v (2600) is a safe number. You can go lower but the device may behave unpredictably.
 #define MIN_SAFE_BATTERY_VOLTAGE 2400
 
+//The internal RC oscillator's frequency changes with the battery voltage (and temperature), which changes the display
+//and user interface timings and the baud rate. It's calibrated against the crystal when the battery voltage has moved
+//more than OSC_RECALIBRATE_MV since last time, and the result kept in the settings.
+#define OSC_RECALIBRATE_MV 100
+#define OSC_TARGET (F_CPU / 128)	//CPU cycles in two steps of TCNT2 (1/128s), at CLOCK_FAST - halved for each step of clockDiv
+#define OSC_MAX_STEPS 32
+
+//Number of ADC conversions averaged for each battery reading, and the number thrown away first while the bandgap reference settles.
+#define VCC_OVERSAMPLE 16
+#define VCC_DISCARD 2
+
+//Filtered battery voltage in millivolts, 0 until the first measurement.
+uint16_t vccFiltered = 0;
+
+//The battery is also sampled while we're asleep, every HEALTH_SAMPLE_INTERVAL RTC ticks (6 hours),
+//and kept in a ring buffer so that the trend can be shown in battery mode. 32 samples is 8 days.
+#define HEALTH_SAMPLE_INTERVAL 21600
+#define VCC_HISTORY_LEN 32
+uint16_t vccHistory[VCC_HISTORY_LEN];
+uint8_t vccHistoryHead = 0;	//Where the next sample goes
+uint8_t vccHistoryCount = 0;
+volatile uint16_t healthTicks = 0;
+volatile boolean healthSampleDue = false;
+
+//Estimated supply current in each power state, in microamps, without the display.
+const uint16_t powerStateCurrent[NUM_PWR_STATES] = {1, 2500, 500};
+//And the display, which dominates, when it's at full brightness. It's accounted for separately, as it's dimmed.
+#define DISPLAY_CURRENT 5500
+//The ADC is accounted for separately, per conversion, as it is used for such short bursts.
+#define ADC_CURRENT 300			//uA, including the bandgap reference
+#define ADC_CONVERSION_US 208	//13 ADC clocks at 62.5kHz
+//Nominal capacity of a CR2032 coin cell, in microamp-hours
+#define BATTERY_CAPACITY_UAH 225000UL
+
+//Time spent in each power state, and awake in each mode, in 1/256s (RTC time).
+uint32_t powerTime[NUM_PWR_STATES];
+uint32_t modeTime[NUM_MODES];
+uint32_t adcConversions = 0;
+volatile uint8_t keypadConversions = 0;	//Counted by the ADC interrupt, and added to adcConversions by powerStateEnter
+uint8_t powerState = PWR_AWAKE;
+uint32_t powerStateSince = 0;
+float displayOnTime = 0;	//Time the display has been on, in 1/256s at full brightness
+
+//The power policy. As the battery runs down, the display is dimmed, modes go back to sleep sooner, and the CPU
+//runs more slowly while it's awake. 8MHz is within the ATmega328P's safe operating area down to about 2.4V (it goes
+//from 4MHz at 1.8V to 10MHz at 2.7V), but a worn cell sags well below its resting voltage under the display's load,
+//so the lowest levels run at 4MHz to keep a margin, as well as to save power.
+//Each level is entered when the battery falls below enterMv, and left when it comes back above leaveMv -
+//a little higher, so that a reading wobbling around one voltage (or a cell recovering after a rest) doesn't flip
+//back and forth. The levels are in order, and the first is where a fresh battery starts.
+typedef struct {
+	uint16_t enterMv;
+	uint16_t leaveMv;
+	uint8_t brightness;		//Out of 255, of settings.brightness
+	uint8_t timeoutPercent;	//Of each mode's usual timeout
+	uint8_t clockAwake;		//clockDiv while awake
+} PowerLevel;
+
+const PowerLevel powerLevels[] = {
+	{0,    0,    255, 100, CLOCK_FAST},
+	{2800, 2850, 160, 75,  CLOCK_FAST},
+	{2650, 2700, 96,  50,  1},			//4MHz
+	{2500, 2550, 48,  33,  1},
+};
+#define POWER_LEVELS ((uint8_t) (sizeof(powerLevels) / sizeof(powerLevels[0])))
+uint8_t powerLevel = 0;
+
+//RAM: everything between the end of the variables and the top of RAM is free for the stack. It is painted
+//with STACK_CANARY at startup, so the deepest the stack has been is the first byte that isn't the canary any more.
+//It's repainted at the end of each mode, so that each mode's worst case (interrupts included) can be kept.
+#define STACK_CANARY 0xC5
+//Warn if the stack has come within this many bytes of the variables.
+#define STACK_MARGIN 128
+uint16_t stackPeak = 0;				//Worst stack use, in bytes, since power-up
+uint16_t modeStackPeak[NUM_MODES];	//And in each mode
+
+//Serial protocol, for setting the time and reading diagnostics from a computer (such as in bulk, after assembly).
+//Each frame is PROTO_SYNC, a command, the length of the payload, the payload, then a check byte - the complement of
+//the sum of the command, length and payload bytes. Multi-byte values are little-endian. The reply to a command has
+//PROTO_REPLY set, or is a PROTO_ERROR frame with the command and one of ProtoErrors. Frames with a bad check byte are
+//ignored, for the computer to send again. The debug text is sent on the same serial port, between the frames.
+//Bytes are received by interrupt (by the Arduino core, or hal.h), and the frames are read and answered in uiWaitEvent,
+//so only while we're awake - the USART stops in deep sleep, so press C/CE/ON first.
+//The baud rate is set from the CPU clock, and changing it spoils any byte being sent or received, so the clock is held
+//at clockAwake while a frame is coming in or a reply going out (see protoBusy). The first byte of a frame may arrive
+//at the idle clock, though, just before it changes - so the computer sends a PROTO_SYNC on its own first, and the
+//frame PROTO_WAKE_MS later. Repeated PROTO_SYNCs before the command are ignored.
+#define PROTO_SYNC 0x7E
+#define PROTO_VERSION 1
+#define PROTO_REPLY 0x80
+#define PROTO_ERROR 0xFF
+#define PROTO_MAX_PAYLOAD 8	//Of the commands we receive - replies can be longer
+#define PROTO_FRAME_MS 100	//Give up on a frame that has stopped part way for this long
+#define PROTO_WAKE_MS 20	//Time for the computer to leave between the first PROTO_SYNC and the frame
+#define PROTO_TZ_AUTO 0xFF	//Work out whether it's BST from the date
+
+enum ProtoCommands {
+	PROTO_PING = 1,		//-> version
+	PROTO_SET_TIME,		//epoch (seconds since 1970, GMT), timezone (0 GMT, 1 BST or PROTO_TZ_AUTO) ->
+	PROTO_STATE,		//-> epoch, timezone, uptime (s), vccFiltered (mV), powerLevel, brightness, OSCCAL
+	PROTO_BATTERY,		//-> number of samples, then vccHistory (mV), oldest first
+	PROTO_COUNTERS		//-> NUM_MODES, powerTime[], adcConversions, modeTime[] (1/256s), latencyCount, latencyWorst (1/2ms), stackPeak
+};
+
+enum ProtoErrors {
+	PROTO_ERR_COMMAND = 1,	//Unknown command
+	PROTO_ERR_LENGTH,		//Wrong length of payload for the command
+	PROTO_ERR_VALUE			//Out of range (such as a date that dateIsValid doesn't allow)
+};
+
+enum ProtoStages {
+	PROTO_WAIT_SYNC = 0,
+	PROTO_WAIT_COMMAND,
+	PROTO_WAIT_LENGTH,
+	PROTO_WAIT_PAYLOAD,
+	PROTO_WAIT_CHECK
+};
+
+uint8_t protoStage = PROTO_WAIT_SYNC;
+uint8_t protoCommand;
+uint8_t protoLength;
+uint8_t protoReceived;
+uint8_t protoPayload[PROTO_MAX_PAYLOAD];
+unsigned long protoLastByte = 0;
+uint8_t protoSum;	//Of the reply being sent
+
+//Function prototypes. The Arduino build generates these, but the bare-metal build needs them written out.
+unsigned long timebaseMillis();
+void timebaseAdvance(uint32_t rtc256);
+void clockSet(uint8_t div);
+void displaySetDuty(uint8_t duty);
+void displaySetCompare();
+void powerPolicy(uint16_t vcc);
+void powerApply();
+uint16_t powerTimeout(uint16_t ms);
+void uiEnter(UiHandler handler, uint16_t timeout);
+void uiSleep();
+void uiSetTimer(uint16_t ms);
+void uiStopTimer();
+uint8_t uiWaitEvent(uint8_t *arg);
+void uiRun();
+void modeFinished();
+void messageHandler(uint8_t ev, uint8_t arg);
+void menuHandler(uint8_t ev, uint8_t arg);
+void startMode(uint8_t mode);
+void remoteHandler(uint8_t ev, uint8_t arg);
+void clockHandler(uint8_t ev, uint8_t kpb);
+uint32_t chronoTime();
+void chronoHandler(uint8_t ev, uint8_t kpb);
+void timerHandler(uint8_t ev, uint8_t kpb);
+void displayTimer();
+void alertHandler(uint8_t ev, uint8_t arg);
+void batteryHandler(uint8_t ev, uint8_t kpb);
+void diagHandler(uint8_t ev, uint8_t kpb);
+void displayDiag(uint8_t page);
+void calculatorClear();
+void calculatorShow();
+uint8_t calculatorChecksum();
+void calculatorRetain();
+void calculatorRestore();
+void calculatorHandler(uint8_t ev, uint8_t keypadButton);
+void displayBest(int64_t i, float f);
+int sign(int64_t num);
+void setHandler(uint8_t ev, uint8_t kpb);
+void setShowOld(uint8_t first);
+void setNextStep();
+void displayMessage(uint8_t msg);
+void rtcService();
+void rtcSnapshot(DateTime *t);
+void rtcCommit(const DateTime *t);
+uint8_t rtcChecksum();
+void rtcRestore();
+uint32_t rtcSeconds();
+uint32_t rtcNow256();
+uint8_t checksum(const void *p, uint8_t len, uint8_t sum);
+uint8_t settingsChecksum(const Settings *s);
+void settingsLoad();
+void settingsSave();
+void settingsSaveTime();
+void updateDisplay();
+uint8_t decodeKeypad(int val);
+int dayOfWeek(int y, int m, int d);
+boolean inBst(int y, int m, int d);
+boolean dateIsValid(int y, int m, int d);
+boolean dateExists(int y, int m, int d);
+boolean leapYear(int y);
+uint8_t daysInMonth(int y, int m);
+void calculateTimezoneCorrection();
+void displayDate();
+void displayTime();
+void displayHms(uint8_t h, uint8_t m, uint8_t sec);
+void displayBattery(uint8_t idx, uint16_t mv);
+void displayChrono(uint32_t t);
+void displayInt64(int64_t num);
+void displayDouble(double num);
+long readVcc();
+uint16_t measureBattery();
+uint16_t oscMeasure();
+void oscCalibrate(uint16_t vcc);
+void sampleHealth();
+void powerStateEnter(uint8_t state);
+float powerAverageCurrent();
+void printPowerReport();
+void printRamReport();
+uint16_t stackHighWater();
+void stackRepaint();
+uint16_t ramStatic();
+uint16_t ramSpare();
+void printLatencyReport();
+boolean protoReceive(uint8_t c, unsigned long now);
+boolean protoBusy(unsigned long now);
+void protoHandle();
+void protoStart(uint8_t command, uint8_t length);
+void protoSend(const void *p, uint8_t length);
+void protoEnd();
+void protoError(uint8_t command, uint8_t error);
+uint32_t epochFromDate(const DateTime *t);
+void dateFromEpoch(uint32_t epoch, DateTime *t);
+void latencyRecord(uint32_t ticks);
+float latencyAverage();
+void goSleepUntilButton();
+void blankDisplay();
+void unblankDisplay();
+
 // create a FILE structure to reference our UART output function
 static FILE uartout = {0};
 
@@ -200,11 +561,16 @@ void setup(){
 	power_twi_disable();
 	power_spi_disable();
 
+	//Timer0 isn't used - the Arduino core starts it for millis(), so stop it again.
+	TCCR0B = 0;
+	TIMSK0 = 0;
+	power_timer0_disable();
+
 	//USART should be powered when serial debugging is enabled.
 	//power_usart0_disable();
 
 	//Configure the serial port for debugging
-	Serial.begin(9600);
+	Serial.begin(SERIAL_BAUD);
 	// fill in the UART file descriptor with pointer to writer.
 	fdev_setup_stream (&uartout, uart_putchar, NULL, _FDEV_SETUP_WRITE);
 	// The uart is the standard output device STDOUT.
@@ -213,8 +579,8 @@ void setup(){
 	//Set up timer 1 - display update
 	TCCR1A = 0;
 	TCCR1B = 0;
-	TCNT1 = PWM_TIME;
-	TCCR1B |= (1 << CS10);    //no prescaler - change to CS12 and set PWM_TIME to 62410 for 256x prescaling
+	TCNT1 = displayReload;
+	TCCR1B |= (1 << CS10);    //no prescaler
 	TIMSK1 |= (1 << TOIE1);   //enable timer overflow interrupt
 
 	//Set up timer 2 - real time clock
@@ -228,330 +594,1064 @@ void setup(){
 	EICRA = (1<<ISC01); //falling edge (button press, not release)
 	EIMSK = (1<<INT0); //Enable the interrupt INT0
 
+	//Load the settings, and pick up the time and calculator where they were if this was only a reset.
+	//This has to be done before the RTC interrupt is enabled.
+	settingsLoad();
+	rtcRestore();
+	calculatorRestore();
+
+	//Start with the oscillator calibration from last time, if there is one.
+	if(settings.osccalVcc)
+		OSCCAL = settings.osccal;
+
+	//Full power until the battery has been measured.
+	powerApply();
+
 	//Enable global interrupts
 	sei();
 
 }
 
-void loop() {
+//How often the keypad is read, and how long to ignore the CE button for after a press (debouncing).
+#define KEY_POLL_MS 10
+#define CE_DEBOUNCE_MS 150
+
+//The keypad is read in the background: every KEY_POLL_MS the display interrupt starts an ADC conversion on
+//the resistor ladder, and the ADC interrupt decodes it. The main loop sleeps through the display interrupts
+//in between, and only wakes up when there's a new sample (or the CE button, or an alert).
+#define KEY_POLL_TICKS (KEY_POLL_MS * 2) //Display interrupts are every 500us
+volatile uint8_t keypadTicks = 0;
+volatile uint8_t keypadSample = NO_KEY;
+volatile boolean keypadSampleReady = false;
+volatile boolean keypadSampling = false;	//A keypad conversion is in progress
+volatile boolean keypadPaused = false;		//The ADC is being used for something else
+volatile uint32_t keypadSampleTicks = 0;	//When keypadSample was read, in timebaseTicks
+
+//Key press latency: from the keypad sample that first saw a key to the first display interrupt after the mode
+//has drawn its response, in half-ms ticks. This includes the KEY_POLL_MS wait for the second sample that
+//debounces it. Each is counted in a histogram of LATENCY_BUCKET_MS wide buckets (the last one is everything
+//longer), which diagnostics mode and the serial report show.
+#define LATENCY_BUCKETS 16
+#define LATENCY_BUCKET_MS 2
+volatile uint16_t latencyHistogram[LATENCY_BUCKETS];
+volatile uint16_t latencyCount = 0;
+volatile uint32_t latencyTotal = 0;
+volatile uint16_t latencyWorst = 0;
+uint32_t latencyKeyTicks = 0;			//When the key being handled was first seen
+volatile boolean latencyDrawn = false;	//Set once it has been handled, for the display interrupt to time
+
+//Handler for the current mode, or 0 once the mode wants us to go back to sleep.
+UiHandler uiHandler = 0;
+uint16_t uiTimeout = 15000; //0 for no timeout
+unsigned long uiLastActivity = 0;
+
+boolean uiTimerRunning = false;
+unsigned long uiTimerStart = 0;
+uint16_t uiTimerLength = 0;
+
+unsigned long uiCePressed = 0;
+uint8_t uiKeyCandidate = NO_KEY;
+uint32_t uiKeyCandidateTicks = 0;
+uint8_t uiKeyDown = NO_KEY;
+
+//The mode selected from the menu, for accounting the time spent in it.
+#define NO_MODE 0xFF
+uint8_t activeMode = NO_MODE;
+uint32_t modeStart = 0;
+
+//The mode to go straight back into when we wake up, and whether we have done so. In that case
+//pressing CE before any other key opens the menu instead of going to the mode.
+uint8_t resumeMode = NO_MODE;
+boolean uiResumed = false;
+
+//Half-milliseconds, counted by the display interrupt while we're awake and moved on by the RTC across
+//deep sleep (see timebaseAdvance). Every second one moves timebaseMs on, which is our timebaseMillis() -
+//timer0 can stay off. It's counted separately, rather than halving timebaseTicks, so that it uses all 32 bits
+//and differences stay right when it wraps.
+volatile uint32_t timebaseTicks = 0;
+volatile uint32_t timebaseMs = 0;
+
+//Milliseconds since power-up. This only runs while the display interrupt does, so it is for the user interface
+//(timeouts, debouncing and so on) - anything that needs to keep counting in deep sleep should use the RTC.
+unsigned long timebaseMillis() {
+	uint8_t oldSREG = SREG;
+	cli();
+	uint32_t t = timebaseMs;
+	SREG = oldSREG;
+	return t;
+}
 
-	//turn off display segments, any pullups (except on CE), screen timer, timer0, ADC, USART (leave only timer2 and INT0 running)
-	goSleepUntilButton();
+//Move the timebase on by some RTC time (in 1/256s), while the display interrupt wasn't counting - in deep sleep,
+//say. Call it with timer 1's interrupt off. 2000/256 = 125/16, split up so that long sleeps don't overflow.
+void timebaseAdvance(uint32_t rtc256) {
+	uint32_t ticks = (rtc256 >> 4) * 125 + (((rtc256 & 15) * 125) >> 4);
+	timebaseMs += (ticks + (timebaseTicks & 1)) >> 1;
+	timebaseTicks += ticks;
+}
 
-	//We've been woken up by a CE-button press.
-	uint8_t mode = 0;
-	displayMessage(MSG_CHRONO);
-	_delay_ms(150);
-	button_pressed = false;
+//Change the CPU clock to F_CPU / (1 << div), keeping everything that is timed by it the same: the display
+//interrupt, the ADC clock (62.5kHz) and the baud rate.
+void clockSet(uint8_t div) {
+
+	if(div == clockDiv)
+		return;
+
+	//Let anything still being sent go at the old baud rate.
+	Serial.flush();
+
+	uint8_t oldSREG = SREG;
+	cli();
+
+	CLKPR = _BV(CLKPCE);
+	CLKPR = div;
+
+	//Scale what's left of the current display period too, so that one isn't longer or shorter.
+	uint16_t left = 65536UL - TCNT1;
+	left = (div > clockDiv) ? (left >> (div - clockDiv)) : (left << (clockDiv - div));
+	TCNT1 = 65536UL - (left ? left : 1);
+	displayReload = 65536UL - (DISPLAY_CYCLES >> div);
+	displaySetCompare();
+
+	//ADIF is cleared by writing a 1, so leave it out - a keypad sample may be waiting for its interrupt.
+	ADCSRA = (ADCSRA & ~(_BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0))) | (7 - div);
+
+	//U2X, as Serial.begin sets it.
+	UBRR0 = ((F_CPU >> div) / 8 / SERIAL_BAUD) - 1;
+
+	clockDiv = div;
+	SREG = oldSREG;
+
+}
+
+//Switch to a new mode handler, which goes back to sleep after timeout ms with no button presses (or never, if it is 0).
+void uiEnter(UiHandler handler, uint16_t timeout) {
+	uiResumed = false;
+	uiHandler = handler;
+	uiTimeout = timeout;
+	uiLastActivity = timebaseMillis();
+	uiTimerRunning = false;
+	handler(EV_ENTER, 0);
+}
+
+//Finish the current mode and go back to sleep.
+void uiSleep() {
+	uiHandler = 0;
+}
+
+//Deliver an EV_TIMER event in ms milliseconds. Each mode has one timer; setting it again restarts it.
+void uiSetTimer(uint16_t ms) {
+	uiTimerStart = timebaseMillis();
+	uiTimerLength = ms;
+	uiTimerRunning = true;
+}
+
+void uiStopTimer() {
+	uiTimerRunning = false;
+}
+
+//Wait for the next event, in idle sleep.
+uint8_t uiWaitEvent(uint8_t *arg) {
+
+	while(1==1) {
+
+		unsigned long now = timebaseMillis();
+
+		if(rtcCalendarPending)
+			rtcService();
+
+		if(alertPending)
+			return EV_ALERT;
 
-	//Record the time - after 2.5s of no presses, enter whatever mode is being displayed
-	long sleepTime = millis();
-	while (millis() - sleepTime < 2500) {
 		if(button_pressed) {
-			mode++;
-			mode = mode % 4;
-			switch(mode){
-			case 0:
-				displayMessage(MSG_CHRONO);
-				break;
-			case 1:
-				displayMessage(MSG_CALC);
-				break;
-			case 2:
-				displayMessage(MSG_REMOTE);
-				break;
-			case 3:
-				displayMessage(MSG_SET);
-				break;
+			button_pressed = false;
+			if((now - uiCePressed) > CE_DEBOUNCE_MS) {
+				uiCePressed = now;
+				uiLastActivity = now;
+				return EV_CE;
+			}
+		}
 
+		//A key has been pressed when it reads the same twice in a row, after something else (usually no key).
+		if(keypadSampleReady) {
+			keypadSampleReady = false;
+			uint8_t key = keypadSample;
+			if((key == uiKeyCandidate) && (key != uiKeyDown)) {
+				uiKeyDown = key;
+				if(key != NO_KEY) {
+					uiLastActivity = now;
+					latencyKeyTicks = uiKeyCandidateTicks;
+					*arg = key;
+					return EV_KEY;
+				}
 			}
-			_delay_ms(150); //Debounce
-			button_pressed = false;
-			sleepTime = millis();
+			if(key != uiKeyCandidate) {
+				uiKeyCandidate = key;
+				uint8_t oldSREG = SREG;
+				cli();
+				uiKeyCandidateTicks = keypadSampleTicks;
+				SREG = oldSREG;
+			}
+		}
+
+		//Commands from the serial port. Each one keeps us awake, as a key press would.
+		while(Serial.available())
+			if(protoReceive(Serial.read(), now))
+				uiLastActivity = now;
+
+		if(rtcTicked) {
+			rtcTicked = false;
+			return EV_TICK;
+		}
+
+		if(uiTimerRunning && ((now - uiTimerStart) >= uiTimerLength)) {
+			uiTimerRunning = false;
+			return EV_TIMER;
+		}
+
+		if(uiTimeout && ((now - uiLastActivity) >= uiTimeout)) {
+			uiLastActivity = now;
+			return EV_TIMEOUT;
 		}
+
+		//Nothing to do yet. Sleep until the next keypad sample - the display interrupts in between don't need us.
+		//(If a sample arrives just before we go to sleep, the next display interrupt wakes us 500us later.)
+		//The interrupts run at the slow clock meanwhile, unless that would upset the serial port.
+		powerStateEnter(PWR_IDLE);
+		clockSet(protoBusy(now) ? clockAwake : clockIdle);
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		while(!keypadSampleReady && !button_pressed && !alertPending && !rtcTicked && !Serial.available())
+			sleep_mode();
+		clockSet(clockAwake);
+		powerStateEnter(PWR_AWAKE);
 	}
 
-	//Single press of CE button enters calculator mode, double press enters clock mode, triple press triggers TV-B-GONE, holding enters clockset mode.
+}
 
+//Deliver events to the current mode until it goes back to sleep.
+void uiRun() {
 
-	//Clock-set mode should account for BST or NOT-BST (whenever the hour, day or month increments, check against the BST conditions?)
-	//Or just require user intervention...
+	uint8_t arg = 0;
+	while(uiHandler) {
+		uint8_t ev = uiWaitEvent(&arg);
 
-	switch(mode){
-	case 0:
-		clockMode();
-		break;
-	case 1:
-		calculatorMode();
-		break;
-	case 2:
-		remoteMode();
-		break;
-	case 3:
-		setMode();
+		//The countdown or the alarm going off takes over from whatever mode we're in, which ends there.
+		if(ev == EV_ALERT) {
+			modeFinished();
+			uiEnter(alertHandler, 60000);
+		}
+		else if((ev == EV_CE) && uiResumed) {
+			modeFinished();
+			uiEnter(menuHandler, 2500);
+		}
+		else {
+			if(ev == EV_KEY)
+				uiResumed = false;
+			uiHandler(ev, arg);
+
+			//Whatever the key changed is in segstates now - the display interrupt times it from here.
+			if(ev == EV_KEY)
+				latencyDrawn = true;
+		}
+	}
+
+	modeFinished();
+
+	//Don't let a bouncing CE button wake us straight back up.
+	while((timebaseMillis() - uiCePressed) <= CE_DEBOUNCE_MS) {
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		sleep_mode();
+	}
+
+}
+
+//Account for the time spent in the mode selected from the menu (and the stack it used), now that we've left it.
+void modeFinished() {
+
+	uint16_t used = stackHighWater();
+	if(used > stackPeak)
+		stackPeak = used;
+
+	if(activeMode != NO_MODE) {
+		modeTime[activeMode] += rtcNow256() - modeStart;
+		if(used > modeStackPeak[activeMode])
+			modeStackPeak[activeMode] = used;
+		activeMode = NO_MODE;
+	}
+
+	stackRepaint();
+}
+
+void loop() {
+
+	//turn off display segments, any pullups (except on CE), screen timer, timer0, ADC, USART (leave only timer2 and INT0 running)
+	goSleepUntilButton();
+
+	//The press that woke us shouldn't count as a press in the menu.
+	uiCePressed = timebaseMillis();
+	button_pressed = false;
+	uiKeyDown = uiKeyCandidate = NO_KEY;
+
+	//Woken by the countdown timer or the alarm, rather than the button?
+	//Otherwise carry on in the last mode, if it can be, rather than walking through the menu again.
+	if(alertPending)
+		uiEnter(alertHandler, 60000);
+	else if(resumeMode != NO_MODE) {
+		startMode(resumeMode);
+		uiResumed = true;
 	}
+	else
+		uiEnter(menuHandler, 2500);
+
+	uiRun();
 
 	//Once the above operation has completed or timed out, we will reach this point in the code.
 
 	//Measure the battery voltage - if we're at less than MIN_SAFE_BATTERY_VOLTAGE, show a warning.
 	//Note that this measurement happens when the display is OFF - this prevents the current draw of the 7-segment displays from affecting the measurements.
-	long vcc = 0;
+	//This takes a few milliseconds, most of it asleep.
 	blankDisplay();
-	//if ((vcc = readVcc()) < MIN_SAFE_BATTERY_VOLTAGE) {
-	displayMessage(MSG_BATT);
-	_delay_ms(1000);
+	uint16_t vcc = measureBattery();
 
-	for(int i=0;i<10;i++) {
-		blankDisplay();
-		vcc = readVcc();
-		displayInt64(vcc);
-		segstates[2] |= 0b10000000;//DP
-		_delay_ms(200);
+	//Dim the display and so on for next time, if the battery has gone down.
+	powerPolicy(vcc);
+
+	//Recalibrate the CPU clock if the battery has changed since it was last done. This needs the display off too,
+	//and is done after the power policy, at the clock speed it has chosen.
+	if((settings.osccalVcc == 0) || (abs((int16_t) (vcc - settings.osccalVcc)) > OSC_RECALIBRATE_MV))
+		oscCalibrate(vcc);
+
+	if (vcc < MIN_SAFE_BATTERY_VOLTAGE) {
+		displayMessage(MSG_LOBATT);
+		uiEnter(messageHandler, 2000);
+		uiRun();
+	}
+
+#ifdef DEBUG_SERIAL
+	printPowerReport();
+	printLatencyReport();
+	printRamReport();
+#endif
+
+	calculatorRetain();
+
+}
+
+//Shows whatever is on the display until a button is pressed or it times out.
+void messageHandler(uint8_t ev, uint8_t arg) {
+	if((ev == EV_KEY) || (ev == EV_CE) || (ev == EV_TIMEOUT))
+		uiSleep();
+}
+
+//The message shown in the menu for each mode.
+const uint8_t modeMessage[NUM_MODES] = {MSG_CLOCK, MSG_CHRONO, MSG_TIMER, MSG_CALC, MSG_REMOTE, MSG_SET, MSG_BATT, MSG_DIAG};
+
+uint8_t menuMode = MODE_CLOCK;
+
+//Each press of CE shows the next mode - after 2.5s of no presses, enter whatever mode is being displayed.
+//Pressing a key enters the mode straight away, and passes the key on to it.
+void menuHandler(uint8_t ev, uint8_t arg) {
+
+	switch(ev) {
+	case EV_ENTER:
+		menuMode = MODE_CLOCK;
+		displayMessage(modeMessage[menuMode]);
+		break;
+
+	case EV_CE:
+		menuMode = (menuMode + 1) % NUM_MODES;
+		displayMessage(modeMessage[menuMode]);
+		break;
+
+	case EV_TIMEOUT:
+		startMode(menuMode);
+		break;
+
+	case EV_KEY:
+		startMode(menuMode);
+		if(uiHandler)
+			uiHandler(EV_KEY, arg);
+		break;
 	}
 
-	// }
+}
+
+//Single press of CE button enters calculator mode, double press enters clock mode, triple press triggers TV-B-GONE, holding enters clockset mode.
+
+//Clock-set mode should account for BST or NOT-BST (whenever the hour, day or month increments, check against the BST conditions?)
+//Or just require user intervention...
+
+void startMode(uint8_t mode) {
+
+	activeMode = mode;
+	modeStart = rtcNow256();
+
+	//The clock, stopwatch, timer and calculator keep their state while we're asleep, so they're
+	//resumed on waking. The others start something afresh, so go back to the menu after them.
+	if(mode <= MODE_CALC)
+		resumeMode = mode;
+	else
+		resumeMode = NO_MODE;
+
+	switch(mode){
+	case MODE_CLOCK:
+		uiEnter(clockHandler, powerTimeout(6000));
+		break;
+	case MODE_CHRONO:
+		uiEnter(chronoHandler, powerTimeout(15000));
+		break;
+	case MODE_TIMER:
+		uiEnter(timerHandler, powerTimeout(15000));
+		break;
+	case MODE_CALC:
+		uiEnter(calculatorHandler, powerTimeout(15000));
+		break;
+	case MODE_REMOTE:
+		uiEnter(remoteHandler, powerTimeout(3000));
+		break;
+	case MODE_SET:
+		uiEnter(setHandler, powerTimeout(15000));
+		break;
+	case MODE_BATT:
+		uiEnter(batteryHandler, powerTimeout(15000));
+		break;
+	case MODE_DIAG:
+		uiEnter(diagHandler, powerTimeout(15000));
+	}
 
 }
 
 //Can't fit remote and calculator modes in to memory at the same time.
-void remoteMode(){
+void remoteHandler(uint8_t ev, uint8_t arg) {
 
-	displayMessage(MSG_TODO);
-	_delay_ms(3000);
+	if(ev == EV_ENTER)
+		displayMessage(MSG_TODO);
+	else if((ev == EV_CE) || (ev == EV_TIMEOUT))
+		uiSleep();
 
 }
 
-void clockMode() {
+boolean clockShowingTime = false;
+
+void clockHandler(uint8_t ev, uint8_t kpb) {
 
 	//CLOCK MODE
+	//Shows the date for 3s, then the time until the mode times out. The time is only redrawn when
+	//the RTC ticks, so the CPU spends the rest of the second asleep.
+	//= keeps the clock on until CE is pressed, for use as a desk clock.
 
 	//Accounts for timezone (tzc_ means timezone-corrected)
 	//Seconds, minutes never change between timezones, only hours/days/months
 	//This only allows for positive timezone change of (timezone) hours WRT. GMT. Wouldn't try this over more than a 23 hour shift
 
+	switch(ev) {
+	case EV_ENTER:
+		clockShowingTime = false;
+		calculateTimezoneCorrection();
+		displayDate();
+		uiSetTimer(3000);
+		break;
 
-	calculateTimezoneCorrection();
-	displayDate();
-	_delay_ms(3000);
+	case EV_TIMER:
+		clockShowingTime = true;
+		//Fall through, to show the time.
 
+	case EV_TICK:
+		if(clockShowingTime) {
+			calculateTimezoneCorrection();
+			displayTime();
+		}
+		break;
 
-	for(int i=0;i<300;i++) {
-		calculateTimezoneCorrection();
-		displayTime();
-		_delay_ms(10);
+	case EV_KEY:
+		if(kpb == KEY_EQ)
+			uiTimeout = uiTimeout?0:powerTimeout(6000);
+		break;
+
+	case EV_CE:
+	case EV_TIMEOUT:
+		uiSleep();
+		break;
 	}
 
+}
 
+//Stopwatch state. This lives in RAM and is timed by the RTC, so the stopwatch keeps counting
+//while we're in deep sleep, at no extra cost.
+#define MAX_LAPS 9
+boolean chronoRunning = false;
+uint32_t chronoStart = 0;	//RTC time (in 1/256s) when the stopwatch was last started
+uint32_t chronoElapsed = 0;	//Time (in 1/256s) accumulated before the last stop
+uint32_t chronoSplits[MAX_LAPS];	//Elapsed time at each split, in 1/256s
+uint8_t chronoSplitCount = 0;
+
+//Is the display frozen on a split or lap time?
+boolean chronoHolding = false;
+
+//Elapsed stopwatch time, in 1/256s.
+uint32_t chronoTime() {
+	if(chronoRunning)
+		return chronoElapsed + (rtcNow256() - chronoStart);
+	return chronoElapsed;
 }
 
-//Helper functions to make a number positive or negative.
-int64_t makeNegative(int64_t i){return(i<0?i:-i);}
-int64_t makePositive(int64_t i){return(i<0?-i:i);}
-float makeNegativef(float i){return(i<0?i:-i);}
-float makePositivef(float i){return(i<0?-i:i);}
+void chronoHandler(uint8_t ev, uint8_t kpb) {
 
-#define NO_OPERATION 42
+	//STOPWATCH MODE
+	//= starts and stops, + takes a split (press again to go back to the running time),
+	//- resets when stopped, 1-9 recall the time of that lap, 0 goes back to the running time.
+	//After 15s or if CE pressed, go to sleep again. The stopwatch keeps running.
+
+	switch(ev) {
+	case EV_ENTER:
+		chronoHolding = false;
+		displayChrono(chronoTime());
+		uiSetTimer(10);
+		return;
+
+	case EV_TIMER:
+		if(!chronoHolding)
+			displayChrono(chronoTime());
+		uiSetTimer(10);
+		return;
+
+	case EV_CE:
+	case EV_TIMEOUT:
+		uiSleep();
+		return;
+
+	case EV_TICK:
+		return;
+	}
 
-void calculatorMode() {
+	switch(kpb) {
+	case KEY_EQ:
+		//Start/stop
+		if(chronoRunning) {
+			chronoElapsed = chronoTime();
+			chronoRunning = false;
+		} else {
+			chronoStart = rtcNow256();
+			chronoRunning = true;
+		}
+		chronoHolding = false;
+		break;
 
-	//Start at zero.
-	displayInt64(0);
+	case KEY_ADD:
+		//Split - freeze the display on the current time, while carrying on counting underneath.
+		if(chronoHolding) {
+			chronoHolding = false;
+		}
+		else if(chronoRunning) {
+			uint32_t t = chronoTime();
+			if(chronoSplitCount < MAX_LAPS)
+				chronoSplits[chronoSplitCount++] = t;
+			displayChrono(t);
+			chronoHolding = true;
+		}
+		break;
 
-	//Sleep timer
-	unsigned long sleepTime = millis();
+	case KEY_SUB:
+		//Reset - only when stopped, so a running timing can't be lost by accident.
+		if(!chronoRunning) {
+			chronoElapsed = 0;
+			chronoSplitCount = 0;
+			chronoHolding = false;
+		}
+		break;
 
-	boolean justPressedEquals = false;
+	case KEY_0:
+		chronoHolding = false;
+		break;
 
-	//Our running totals, floating-point and integer.
-	int64_t iCurrNum = 0;
-	int64_t iEntNum = 0;
-	float fCurrNum = 0.0f;
-	float fEntNum = 0.0f;
+	default:
+		//Recall lap n - the time between split n-1 and split n.
+		if((kpb >= KEY_1) && (kpb <= KEY_9) && (kpb <= chronoSplitCount)) {
+			uint32_t lap = chronoSplits[kpb-1];
+			if(kpb > 1)
+				lap -= chronoSplits[kpb-2];
+			displayChrono(lap);
+			chronoHolding = true;
+		}
+		break;
+	}
 
-	float enteringSB = 0.1;
+	if(!chronoHolding)
+		displayChrono(chronoTime());
 
-	//Wait for a keypad button to be pressed
-	uint8_t keypadButton = NO_KEY;
+}
 
-	uint8_t operation = NO_OPERATION;
+uint32_t timerEntry = 0; //Up to six digits, HHMMSS
+boolean timerEntering = false;
+boolean timerShowingMessage = false;
+
+void timerHandler(uint8_t ev, uint8_t kpb) {
+
+	//COUNTDOWN TIMER AND ALARM MODE
+	//Digits are typed in from the right, like a microwave oven.
+	//= starts a countdown of HH.MM.SS, + sets the daily alarm to HH.MM (the last four digits),
+	//- cancels both, . shows the alarm time.
+	//Neither needs us to stay awake - the RTC interrupt wakes us up when they go off.
+	//After 15s or if CE pressed, go to sleep again. Anything armed stays armed.
+
+	switch(ev) {
+	case EV_ENTER:
+		timerEntry = 0;
+		timerEntering = false;
+		timerShowingMessage = false;
+		displayTimer();
+		return;
 
-	//Entering a negative number?
-	boolean enteringNegativeNumber = false;
-	boolean enteringAfterDP = false;
+	case EV_TIMER:
+		//A message has been shown for long enough.
+		timerShowingMessage = false;
+		//Fall through, to show the countdown again.
 
-	//Loop until we're finished, and re-enter power save mode.
-	while(1==1) {
+	case EV_TICK:
+		if(!timerEntering && !timerShowingMessage)
+			displayTimer();
+		return;
 
-		while((keypadButton = readKeypad()) == NO_KEY) {
+	case EV_CE:
+	case EV_TIMEOUT:
+		uiSleep();
+		return;
+	}
 
-			//Sleep timer exceeded?
-			if ((millis() - sleepTime) > 15000)
-				return; //After 15s go to sleep again.
+	timerShowingMessage = false;
 
-			//CE Button pressed.
-			if(button_pressed)
-			{
-				button_pressed = false;
-				justPressedEquals = false;
-				displayInt64(0);
-				operation = NO_OPERATION;
-				iCurrNum = 0;
-				iEntNum = 0;
-				fCurrNum = 0.0f;
-				fEntNum = 0.0f;
-				enteringNegativeNumber = false;
-				enteringAfterDP = false;
-				enteringSB = 0.1;
-				sleepTime = millis();
-			}
+	if(kpb < 10) {
+		timerEntry = (timerEntry * 10 + kpb) % 1000000;
+		timerEntering = true;
+		displayHms(timerEntry / 10000, (timerEntry / 100) % 100, timerEntry % 100);
+		return;
+	}
+
+	if(kpb == KEY_EQ) {
+		uint32_t duration = (timerEntry / 10000) * 3600UL + ((timerEntry / 100) % 100) * 60UL + (timerEntry % 100);
+		if(duration > 0) {
+			//Disarm while the target is changed, so the interrupt never sees half of it.
+			countdownArmed = false;
+			countdownTarget = rtcSeconds() + duration;
+			countdownArmed = true;
+			displayMessage(MSG_DONE);
+			timerShowingMessage = true;
+		}
+	}
+	else if(kpb == KEY_ADD) {
+		uint8_t h = (timerEntry / 100) % 100;
+		uint8_t m = timerEntry % 100;
+		if((h < 24) && (m < 60)) {
+			alarmArmed = false;
+			alarmHours = h;
+			alarmMinutes = m;
+			alarmArmed = true;
+			displayMessage(MSG_DONE);
+		} else {
+			displayMessage(MSG_ERROR);
 		}
+		timerShowingMessage = true;
+	}
+	else if(kpb == KEY_SUB) {
+		countdownArmed = false;
+		alarmArmed = false;
+	}
+	else if(kpb == KEY_DP) {
+		//Show the alarm time - with a decimal point on the last digit if it's armed.
+		displayHms(alarmHours, alarmMinutes, 0);
+		segstates[4] = 0;
+		segstates[5] = alarmArmed?(1<<7):0;
+		timerShowingMessage = true;
+	}
 
-		//A key has been pressed.
+	timerEntry = 0;
+	timerEntering = false;
 
+	if(timerShowingMessage)
+		uiSetTimer(1500);
+	else {
+		uiStopTimer();
+		displayTimer();
+	}
 
+}
 
+//Show the time left on the countdown, or zeros if it isn't running.
+void displayTimer() {
+	uint32_t left = 0;
+	if(countdownArmed)
+		left = countdownTarget - rtcSeconds();
+	displayHms((left / 3600) % 100, (left / 60) % 60, left % 60);
+}
 
+uint8_t alertFlashes = 0;
 
+//The countdown or the alarm has gone off. Flash the display and the LED until a button is pressed, or for 30s.
+void alertHandler(uint8_t ev, uint8_t arg) {
 
-		//It's a number.
-		if (keypadButton < 10)
-		{
+	switch(ev) {
+	case EV_ENTER:
+		alertPending = false;
+		alertFlashes = 0;
+		//Fall through, to show the first flash.
 
-			if(enteringNegativeNumber)
-			{
-				iEntNum = makePositive(iEntNum);
-				fEntNum = makePositivef(fEntNum);
-			}
+	case EV_TIMER:
+		if(alertFlashes & 1) {
+			blankDisplay();
+			digitalWrite(ledPin, LOW);
+		} else {
+			displayMessage(MSG_ALARM);
+			digitalWrite(ledPin, HIGH);
+		}
 
-			if(enteringAfterDP) {
+		if(++alertFlashes <= 120) {
+			uiSetTimer(250);
+			break;
+		}
+		//Fall through - we've flashed for long enough.
 
-				//Floats only make sense...
-				fEntNum = fEntNum + enteringSB * keypadButton;
-				enteringSB *= 0.1;
+	case EV_KEY:
+	case EV_CE:
+	case EV_TIMEOUT:
+		digitalWrite(ledPin, LOW);
+		blankDisplay();
+		uiSleep();
+		break;
+	}
 
-			}
-			else {
-				iEntNum = iEntNum * 10;
-				iEntNum = iEntNum + keypadButton;
+}
 
-				fEntNum = fEntNum * 10;
-				fEntNum = fEntNum + keypadButton;
-			}
+uint16_t battNow = 0;
+uint8_t battIdx = 0;
 
-			if(enteringNegativeNumber)
-			{
-				iEntNum = makeNegative(iEntNum);
-				fEntNum = makeNegativef(fEntNum);
-			}
-			displayBest(iEntNum, fEntNum);
+void batteryHandler(uint8_t ev, uint8_t kpb) {
 
-			//Wait for button release - numbers don't have a "press-hold" alt function, so we just
-			//spin here, after the number has been displayed, to minmimise perceived lag.
-			while(readKeypad()!=NO_KEY)
-			{;}
+	//BATTERY MODE
+	//Shows the battery voltage now (00), then the samples taken while asleep, newest (01) to oldest.
+	//+ steps back in time, - steps forward, = goes back to now.
+
+	switch(ev) {
+	case EV_ENTER:
+		blankDisplay();
+		battNow = measureBattery();
+		battIdx = 0;
+		break;
+
+	case EV_KEY:
+		if((kpb == KEY_ADD) && (battIdx < vccHistoryCount))
+			battIdx++;
+		else if((kpb == KEY_SUB) && (battIdx > 0))
+			battIdx--;
+		else if(kpb == KEY_EQ)
+			battIdx = 0;
+		break;
 
+	case EV_CE:
+	case EV_TIMEOUT:
+		uiSleep();
+		return;
+
+	case EV_TICK:
+		return;
+	}
+
+	if(battIdx == 0)
+		displayBattery(0, battNow);
+	else
+		displayBattery(battIdx, vccHistory[(vccHistoryHead + VCC_HISTORY_LEN - battIdx) % VCC_HISTORY_LEN]);
+
+}
+
+void diagHandler(uint8_t ev, uint8_t kpb) {
+
+	//DIAGNOSTIC MODE
+	//Press a number to choose what is shown:
+	//1 - projected battery life, in days
+	//2 - average current, in microamps
+	//3 - total time awake, in seconds
+	//4 - total time asleep, in hours
+	//5 - number of ADC conversions
+	//6 - average key press latency, in milliseconds
+	//7 - worst key press latency, in milliseconds
+	//8 - number of key presses timed
+	//9 - RAM the stack has never reached, in bytes
+
+	switch(ev) {
+	case EV_ENTER:
+		displayDiag(1);
+		break;
+
+	case EV_KEY:
+		if((kpb >= KEY_1) && (kpb <= KEY_9))
+			displayDiag(kpb);
+		break;
+
+	case EV_CE:
+	case EV_TIMEOUT:
+		uiSleep();
+		break;
+	}
+
+}
+
+void displayDiag(uint8_t page) {
+
+	//Bring the current state's time up to date first.
+	powerStateEnter(powerState);
+
+	switch(page) {
+	case 1:
+		displayInt64(lround(BATTERY_CAPACITY_UAH / powerAverageCurrent() / 24));
+		break;
+	case 2:
+		displayDouble(powerAverageCurrent());
+		break;
+	case 3:
+		displayInt64(powerTime[PWR_AWAKE] >> 8);
+		break;
+	case 4:
+		displayInt64((powerTime[PWR_SLEEP] >> 8) / 3600);
+		break;
+	case 5:
+		displayInt64(adcConversions);
+		break;
+	//(The display interrupt only adds to these just after a key has been handled, so not while we're reading them.)
+	case 6:
+		displayDouble(latencyAverage());
+		break;
+	case 7:
+		displayDouble(latencyWorst / 2.0);
+		break;
+	case 8:
+		displayInt64(latencyCount);
+		break;
+	case 9:
+		displayInt64(ramSpare());
+		break;
+	}
+
+}
+
+//Helper functions to make a number positive or negative.
+int64_t makeNegative(int64_t i){return(i<0?i:-i);}
+int64_t makePositive(int64_t i){return(i<0?-i:i);}
+float makeNegativef(float i){return(i<0?i:-i);}
+float makePositivef(float i){return(i<0?-i:i);}
+
+#define NO_OPERATION 42
+
+//Calculator state. Our running totals, floating-point and integer, and the number being entered.
+//This is kept through a reset too - calculatorRetain updates calcCheck before we go to sleep, and
+//calculatorRestore clears it all at startup unless the check matches.
+boolean justPressedEquals NOINIT;
+int64_t iCurrNum NOINIT;
+int64_t iEntNum NOINIT;
+float fCurrNum NOINIT;
+float fEntNum NOINIT;
+float enteringSB NOINIT;
+uint8_t operation NOINIT;
+
+//Entering a negative number?
+boolean enteringNegativeNumber NOINIT;
+boolean enteringAfterDP NOINIT;
+
+//Is the display showing the running total (rather than the number being entered)?
+boolean calcShowingTotal NOINIT;
+
+uint8_t calcCheck NOINIT;
+
+//Start again from zero.
+void calculatorClear() {
+	justPressedEquals = false;
+	operation = NO_OPERATION;
+	iCurrNum = 0;
+	iEntNum = 0;
+	fCurrNum = 0.0f;
+	fEntNum = 0.0f;
+	enteringNegativeNumber = false;
+	enteringAfterDP = false;
+	enteringSB = 0.1;
+	calcShowingTotal = false;
+}
+
+//Show whichever number was on the display last.
+void calculatorShow() {
+	if(calcShowingTotal)
+		displayBest(iCurrNum, fCurrNum);
+	else
+		displayBest(iEntNum, fEntNum);
+}
+
+//Checksum of the calculator state.
+uint8_t calculatorChecksum() {
+	uint8_t sum = checksum(&iCurrNum, sizeof(iCurrNum), 0);
+	sum = checksum(&iEntNum, sizeof(iEntNum), sum);
+	sum = checksum(&fCurrNum, sizeof(fCurrNum), sum);
+	sum = checksum(&fEntNum, sizeof(fEntNum), sum);
+	sum = checksum(&enteringSB, sizeof(enteringSB), sum);
+	sum += justPressedEquals + operation + enteringNegativeNumber + enteringAfterDP + calcShowingTotal;
+	return ~sum;
+}
+
+//Called before we go to sleep, so that the calculator state can be trusted after a reset.
+void calculatorRetain() {
+	calcCheck = calculatorChecksum();
+}
+
+//Called at startup - keep the calculator state if it survived a reset, otherwise start from zero.
+void calculatorRestore() {
+	if(calcCheck != calculatorChecksum())
+		calculatorClear();
+}
+
+void calculatorHandler(uint8_t ev, uint8_t keypadButton) {
+
+	switch(ev) {
+	case EV_ENTER:
+		//Carry on from where we left off - CE starts again.
+		calculatorShow();
+		return;
+
+	case EV_CE:
+		calculatorClear();
+		displayInt64(0);
+		return;
+
+	case EV_TIMER:
+		//The error message has been shown for long enough.
+		displayInt64(0);
+		return;
+
+	case EV_TIMEOUT:
+		uiSleep(); //After 15s go to sleep again.
+		return;
+
+	case EV_TICK:
+		return;
+	}
+
+	//A key has been pressed. Any error message is cut short.
+	uiStopTimer();
+
+	//It's a number.
+	if (keypadButton < 10)
+	{
+
+		if(enteringNegativeNumber)
+		{
+			iEntNum = makePositive(iEntNum);
+			fEntNum = makePositivef(fEntNum);
 		}
 
-		//It's not a number, it's a special button.
+		if(enteringAfterDP) {
+
+			//Floats only make sense...
+			fEntNum = fEntNum + enteringSB * keypadButton;
+			enteringSB *= 0.1;
+
+		}
 		else {
+			iEntNum = iEntNum * 10;
+			iEntNum = iEntNum + keypadButton;
+
+			fEntNum = fEntNum * 10;
+			fEntNum = fEntNum + keypadButton;
+		}
+
+		if(enteringNegativeNumber)
+		{
+			iEntNum = makeNegative(iEntNum);
+			fEntNum = makeNegativef(fEntNum);
+		}
+		calcShowingTotal = false;
+		displayBest(iEntNum, fEntNum);
 
-			int keyTime = 0;
-			//Time how long the button is held for.
-			while(readKeypad()!=NO_KEY)
-			{keyTime++; _delay_ms(10);}
+	}
 
-			printf("Key held for %i ms \n", (keyTime * 10));
+	//It's not a number, it's a special button.
+	else {
 
-			//Is it an operation, or a negative sign?
-			if(((iEntNum == 0) && (keypadButton == KEY_SUB)) || (keypadButton == KEY_DP))
+		//Is it an operation, or a negative sign?
+		if(((iEntNum == 0) && (keypadButton == KEY_SUB)) || (keypadButton == KEY_DP))
+		{
+			if(keypadButton == KEY_SUB) {
+				//We're entering a negative number...
+				enteringNegativeNumber = true;
+				Serial.println("Entering a negative number");
+			} else
 			{
-				if(keypadButton == KEY_SUB) {
-					//We're entering a negative number...
-					enteringNegativeNumber = true;
-					Serial.println("Entering a negative number");
-				} else
-				{
-					//We're pressing the decimal place here...
-					enteringAfterDP = true;
-					enteringSB = 0.1;
-					//TODO implement this logic
-					Serial.println("Decimal place pressed...");
-				}
+				//We're pressing the decimal place here...
+				enteringAfterDP = true;
+				enteringSB = 0.1;
+				//TODO implement this logic
+				Serial.println("Decimal place pressed...");
 			}
+		}
+
+		else {
+			if (justPressedEquals && (keypadButton != KEY_EQ)){}
 
 			else {
-				if (justPressedEquals && (keypadButton != KEY_EQ)){}
-
-				else {
-					//We've pressed an operation
-
-					switch((operation)){
-					case NO_OPERATION:
-						iCurrNum = iEntNum;
-						fCurrNum = fEntNum;
-						break;
-					case KEY_ADD:
-						iCurrNum = iCurrNum + iEntNum;
-						fCurrNum = fCurrNum + fEntNum;
-						break;
-					case KEY_SUB:
-						iCurrNum = iCurrNum - iEntNum;
-						fCurrNum = fCurrNum - fEntNum;
-						break;
-					case KEY_MUL:
-						iCurrNum = iCurrNum * iEntNum;
-						fCurrNum = fCurrNum * fEntNum;
-						break;
-					case KEY_DIV:
-						if (fEntNum == 0) { //Prevent division by zero
-							displayMessage(MSG_ERROR);
-							_delay_ms(3000);
-							button_pressed = true;
-						}
-						if(iEntNum == 0)
-							iCurrNum = 2^60 * sign(iCurrNum);//infinity-ish
-						else
-							iCurrNum = iCurrNum / iEntNum;
-
-						fCurrNum = fCurrNum / fEntNum;
-						break;
+				//We've pressed an operation
+
+				switch((operation)){
+				case NO_OPERATION:
+					iCurrNum = iEntNum;
+					fCurrNum = fEntNum;
+					break;
+				case KEY_ADD:
+					iCurrNum = iCurrNum + iEntNum;
+					fCurrNum = fCurrNum + fEntNum;
+					break;
+				case KEY_SUB:
+					iCurrNum = iCurrNum - iEntNum;
+					fCurrNum = fCurrNum - fEntNum;
+					break;
+				case KEY_MUL:
+					iCurrNum = iCurrNum * iEntNum;
+					fCurrNum = fCurrNum * fEntNum;
+					break;
+				case KEY_DIV:
+					if (fEntNum == 0) { //Prevent division by zero
+						//Show an error for 3s (or until the next key), then start again from zero.
+						calculatorClear();
+						displayMessage(MSG_ERROR);
+						uiSetTimer(3000);
+						return;
 					}
-				}
+					if(iEntNum == 0)
+						iCurrNum = 2^60 * sign(iCurrNum);//infinity-ish
+					else
+						iCurrNum = iCurrNum / iEntNum;
 
-				if(keypadButton == KEY_EQ){
-					justPressedEquals = true;
-					//This leads to one subtle problem
-					//Say you type 2 + 2 = = + 3
-					//Calc does 2+2+2+2 +3
-					//Expected behaviour 2+2+2 +3
-				} else {
-					justPressedEquals = false;
-					iEntNum = 0;
-					fEntNum = 0.0f;
-					enteringNegativeNumber = false;
-					enteringAfterDP = false;
-					enteringSB = 0.1;
-					operation = keypadButton;
+					fCurrNum = fCurrNum / fEntNum;
+					break;
 				}
+			}
 
-				displayBest(iCurrNum, fCurrNum);
-
-
+			if(keypadButton == KEY_EQ){
+				justPressedEquals = true;
+				//This leads to one subtle problem
+				//Say you type 2 + 2 = = + 3
+				//Calc does 2+2+2+2 +3
+				//Expected behaviour 2+2+2 +3
+			} else {
+				justPressedEquals = false;
+				iEntNum = 0;
+				fEntNum = 0.0f;
+				enteringNegativeNumber = false;
+				enteringAfterDP = false;
+				enteringSB = 0.1;
+				operation = keypadButton;
 			}
 
+			calcShowingTotal = true;
+			displayBest(iCurrNum, fCurrNum);
 
 
 		}
 
-
-
-		_delay_ms(50);
-
-		//Reset the timer, something's been pressed.
-		sleepTime = millis();
 	}
 
-
 }
 
 void displayBest(int64_t i, float f) {
@@ -584,157 +1684,188 @@ int sign(int64_t num){
 	return 0;
 }
 
+//The steps of setting the clock. Prompts and messages move on to the next step after a delay, or straight away when a key is pressed.
+enum SetSteps {
+	SET_DATE_PROMPT = 0,
+	SET_DATE_SHOW,
+	SET_DATE_ENTRY,
+	SET_DATE_ERROR,
+	SET_TIME_PROMPT,
+	SET_TIME_SHOW,
+	SET_TIME_ENTRY,
+	SET_DONE
+};
+
+uint8_t setStep = SET_DATE_PROMPT;
+uint8_t setDigits = 0;
+uint8_t setValues[6];
+
+//The current (GMT) datetime, when set mode was entered.
+uint8_t setOld[6];
+
+//The new datetime. Nothing is changed until all of it has been entered, when it is committed in one go.
+DateTime setNew;
+
 //Mode for setting the clock time.
-void setMode() {
-
-	//Copy the current (GMT) datetime into a set of variables
-	uint8_t l_seconds = seconds;
-	uint8_t l_minutes = minutes;
-	uint8_t l_hours = hours;
-	uint8_t l_days = day;
-	uint8_t l_months = month;
-	int l_years = year;
-
-	//First enter date...
-	displayMessage(MSG_DATE);
-	_delay_ms(2500);
-	segstates[0] = number[(l_days/10)%10];
-	segstates[1] = number[(l_days)%10] WITH_DECIMAL_POINT;
-	segstates[2] = number[(l_months/10)%10];
-	segstates[3] = number[(l_months)%10] WITH_DECIMAL_POINT;
-	segstates[4] = number[((l_years-2000)/10)%10];
-	segstates[5] = number[((l_years-2000))%10];
-
-	_delay_ms(250);
-	segstates[0] = 0;	//Blank the first digit.
-
-	long sleepTime = millis();
-	uint8_t kpb = NO_KEY;
-	//Update date_time (if not C/CE pressed)
-	int i = 0;
-	uint8_t values[6];
-
-	while(i<6) {
-		while((kpb = readKeypad()) == NO_KEY) {
-			if (((millis() - sleepTime) > 15000) || button_pressed)
-				return; //After 15s or if CE pressed, go to sleep again, without saving the changes to the time.
-		}
+void setHandler(uint8_t ev, uint8_t kpb) {
+
+	switch(ev) {
+	case EV_ENTER:
+		//Copy the current (GMT) datetime into a set of variables
+		rtcSnapshot(&setNew);
+		setOld[0] = setNew.day;
+		setOld[1] = setNew.month;
+		setOld[2] = setNew.year - 2000;
+		setOld[3] = setNew.hours;
+		setOld[4] = setNew.minutes;
+		setOld[5] = setNew.seconds;
+
+		//First enter date...
+		setStep = SET_DATE_PROMPT;
+		displayMessage(MSG_DATE);
+		uiSetTimer(2500);
+		break;
 
-		if(kpb < 10)
-		{
-			//Valid number pressed
-			segstates[i] = number[kpb];
-			values[i] = kpb;
-			if((i==1) || (i==3))
-				segstates[i] |= 0b10000000;
-			if(i<=4)
-				segstates[i+1] = 0;//Blank the next
-
-			i++;
-		}
+	case EV_TIMER:
+		setNextStep();
+		break;
 
+	case EV_KEY:
+		//A key skips any prompt or message.
+		while(uiHandler && (setStep != SET_DATE_ENTRY) && (setStep != SET_TIME_ENTRY))
+			setNextStep();
 
-		//Wait for the key to be released.
-		while((kpb = readKeypad()) != NO_KEY)
-			_delay_ms(50);
+		if(!uiHandler || (kpb >= 10))
+			break;
 
-		//Don't go to sleep if the button has been pressed.
-		sleepTime = millis();
+		//Valid number pressed
+		segstates[setDigits] = number[kpb];
+		setValues[setDigits] = kpb;
+		if((setDigits==1) || (setDigits==3))
+			segstates[setDigits] |= 0b10000000;
+		if(setDigits<=4)
+			segstates[setDigits+1] = 0;//Blank the next
+
+		if(++setDigits == 6)
+			setNextStep();
+		break;
 
+	case EV_CE:
+	case EV_TIMEOUT:
+		//After 15s or if CE pressed, go to sleep again, without saving the changes to the time.
+		uiSleep();
+		break;
 	}
 
-	//OK, so we have an array of digits.
-	int hypotheticalDays    = values[0]*10+values[1];
-	int hypotheticalMonths  = values[2]*10+values[3];
-	int hypotheticalYears   = values[4]*10+values[5] + 2000;
+}
 
-	//Check if the given date is valid.
-	if(!dateIsValid(hypotheticalYears, hypotheticalMonths, hypotheticalDays))
-	{
-		//Note there's no way for the year to be invalid, I believe.
-		hypotheticalDays = 1;
-		hypotheticalMonths = 1;
-		hypotheticalYears = 2013;
-		displayMessage(MSG_ERROR);
-		_delay_ms(5000);
+//Show two-digit values separated by decimal points, for the user to type over.
+void setShowOld(uint8_t first) {
+	for(uint8_t i=0;i<3;i++) {
+		segstates[i*2] = number[(setOld[first+i]/10)%10];
+		segstates[i*2+1] = number[setOld[first+i]%10];
 	}
+	segstates[1] |= 0b10000000;
+	segstates[3] |= 0b10000000;
+}
 
-	printf("Setting d=%i, m=%i, y=%i \n", hypotheticalDays, hypotheticalMonths, hypotheticalYears);
-
-	day = hypotheticalDays;
-	month = hypotheticalMonths;
-	year = hypotheticalYears;
+void setNextStep() {
 
-	//Repeat for the time.
+	uiStopTimer();
 
-	displayMessage(MSG_TIME);
-	_delay_ms(2500);
-	segstates[0] = number[(l_hours/10)%10];
-	segstates[1] = number[(l_hours)%10] WITH_DECIMAL_POINT;
-	segstates[2] = number[(l_minutes/10)%10];
-	segstates[3] = number[(l_minutes)%10] WITH_DECIMAL_POINT;
-	segstates[4] = number[((l_seconds)/10)%10];
-	segstates[5] = number[(l_seconds)%10];
+	switch(setStep) {
+	case SET_DATE_PROMPT:
+		setShowOld(0);
+		setStep = SET_DATE_SHOW;
+		uiSetTimer(250);
+		break;
 
-	_delay_ms(250);
-	segstates[0] = 0;//Blank the first digit.
+	case SET_DATE_SHOW:
+	case SET_TIME_SHOW:
+		segstates[0] = 0;	//Blank the first digit.
+		setDigits = 0;
+		setStep++;
+		break;
 
-	sleepTime = millis();
-	kpb = NO_KEY;
-	i=0;
-	while(i<6) {
-		while((kpb = readKeypad()) == NO_KEY) {
-			if (((millis() - sleepTime) > 15000) || button_pressed)
-				return; //After 15s or if CE pressed, go to sleep again, without saving the changes to the time.
-		}
+	case SET_DATE_ENTRY: {
+		//OK, so we have an array of digits.
+		int hypotheticalDays    = setValues[0]*10+setValues[1];
+		int hypotheticalMonths  = setValues[2]*10+setValues[3];
+		int hypotheticalYears   = setValues[4]*10+setValues[5] + 2000;
 
-		if(kpb < 10)
+		//Check if the given date is valid.
+		boolean valid = dateIsValid(hypotheticalYears, hypotheticalMonths, hypotheticalDays);
+		if(!valid)
 		{
-			//Valid number pressed
-			segstates[i] = number[kpb];
-			values[i] = kpb;
-			if((i==1) || (i==3))
-				segstates[i] |= 0b10000000;
-			if(i<=4)
-				segstates[i+1] = 0;//Blank the next
-
-			i++;
+			//Note there's no way for the year to be invalid, I believe.
+			hypotheticalDays = 1;
+			hypotheticalMonths = 1;
+			hypotheticalYears = 2013;
 		}
 
+		printf("Setting d=%i, m=%i, y=%i \n", hypotheticalDays, hypotheticalMonths, hypotheticalYears);
 
-		//Wait for the key to be released.
-		while((kpb = readKeypad()) != NO_KEY)
-			_delay_ms(50);
-
-		//Don't go to sleep if the button has been pressed.
-		sleepTime = millis();
+		setNew.day = hypotheticalDays;
+		setNew.month = hypotheticalMonths;
+		setNew.year = hypotheticalYears;
 
+		if(!valid) {
+			displayMessage(MSG_ERROR);
+			setStep = SET_DATE_ERROR;
+			uiSetTimer(5000);
+			break;
+		}
 	}
+		//Fall through to the time.
 
+	case SET_DATE_ERROR:
+		//Repeat for the time.
+		displayMessage(MSG_TIME);
+		setStep = SET_TIME_PROMPT;
+		uiSetTimer(2500);
+		break;
 
-	//OK, so we have an array of digits.
-	int hypotheticalHours    = values[0]*10+values[1]  - (inBst(year, month, day)?1:0);
-	int hypotheticalMinutes  = values[2]*10+values[3];
-	int hypotheticalSeconds   = values[4]*10+values[5];
+	case SET_TIME_PROMPT:
+		setShowOld(3);
+		setStep = SET_TIME_SHOW;
+		uiSetTimer(250);
+		break;
 
-	//TODO check if valid time...
+	case SET_TIME_ENTRY: {
+		//OK, so we have an array of digits.
+		boolean bst = inBst(setNew.year, setNew.month, setNew.day);
+		int hypotheticalHours    = setValues[0]*10+setValues[1]  - (bst?1:0);
+		int hypotheticalMinutes  = setValues[2]*10+setValues[3];
+		int hypotheticalSeconds   = setValues[4]*10+setValues[5];
 
-	printf("Setting h=%i, m=%i, s=%i \n", hypotheticalHours, hypotheticalMinutes, hypotheticalSeconds);
-	if(inBst(year, month, day))
-		Serial.print("BST time so -1 hour");
-	else
-		Serial.print("Not BST - setting directly.");
+		//TODO check if valid time...
 
-	hours   = (hypotheticalHours) % 24; //Technically, should subtract one from the day if less then midnight, etc. Edge case ignored for simplicity.
-	minutes = hypotheticalMinutes % 60;
-	seconds = hypotheticalSeconds % 60;
+		printf("Setting h=%i, m=%i, s=%i \n", hypotheticalHours, hypotheticalMinutes, hypotheticalSeconds);
+		if(bst)
+			Serial.print("BST time so -1 hour");
+		else
+			Serial.print("Not BST - setting directly.");
 
-	//Save into GMT time
-	timezone = inBst(year, month, day)?1:0;
+		setNew.hours   = (hypotheticalHours) % 24; //Technically, should subtract one from the day if less then midnight, etc. Edge case ignored for simplicity.
+		setNew.minutes = hypotheticalMinutes % 60;
+		setNew.seconds = hypotheticalSeconds % 60;
+
+		//Save into GMT time
+		setNew.timezone = bst?1:0;
+		rtcCommit(&setNew);
+		settingsSaveTime();
+
+		//Display done message
+		displayMessage(MSG_DONE);
+		setStep = SET_DONE;
+		uiSetTimer(2000);
+		break;
+	}
 
-	//Display done message
-	displayMessage(MSG_DONE);
-	_delay_ms(2000);
+	case SET_DONE:
+		uiSleep();
+		break;
+	}
 
 }
 
@@ -854,6 +1985,42 @@ void displayMessage(uint8_t msg) {
 
 		break;
 
+	case MSG_CLOCK:
+		segstates[0] = 0b00111001;//C
+		segstates[1] = 0b00111000;//L
+		segstates[2] = 0b01011100;//o
+		segstates[3] = 0b01011000;//c
+		segstates[4] = 0;
+		segstates[5] = 0;
+		break;
+
+	case MSG_TIMER:
+		segstates[0] = 0b01111000;//t
+		segstates[1] = 0b00010000;//i
+		segstates[2] = 0b01010100;//m
+		segstates[3] = 0b01000100;//m
+		segstates[4] = 0b01111001;//E
+		segstates[5] = 0b01010000;//r
+		break;
+
+	case MSG_ALARM:
+		segstates[0] = 0b01110111;//A
+		segstates[1] = 0b00111000;//L
+		segstates[2] = 0b01110111;//A
+		segstates[3] = 0b01010000;//r
+		segstates[4] = 0b01010100;//m
+		segstates[5] = 0b01000100;//m
+		break;
+
+	case MSG_DIAG:
+		segstates[0] = 0b01011110;//d
+		segstates[1] = 0b00010000;//i
+		segstates[2] = 0b01110111;//A
+		segstates[3] = 0b01101111;//g
+		segstates[4] = 0;
+		segstates[5] = 0;
+		break;
+
 	case MSG_NEGINF:
 		segstates[0] = 0b01010100;// n
 		segstates[1] = 0b01111001;// e
@@ -873,21 +2040,69 @@ void displayMessage(uint8_t msg) {
 //32.768kHz interrupt handler - this overflows once a second
 //Making this trigger once every 8 seconds would give maximum power savings
 //Unfortunately this would lose the second-level resolution, and break GMT
-//This updates GMT time, detects BST transition
-//TODO simplify/optimise this for power saving
+//This only counts seconds, minutes and hours - no divides, no calendar - so that it never holds up the
+//display interrupt for long. When the hour changes, rtcService does the rest, outside the interrupt.
 SIGNAL(TIMER2_OVF_vect){
 
-	seconds++;
-	minutes +=(seconds/60); //Use integer division intentionally here.
-	seconds = seconds % 60;
-	hours += (minutes/60);
-	minutes = minutes % 60;
+	rtcTicks++;
+	rtcTicked = true;
+
+	if (++seconds >= 60) {
+		seconds = 0;
+		if (++minutes >= 60) {
+			minutes = 0;
+			hours++;
+			rtcCalendarPending = true;
+		}
+	}
+	rtcCheck = rtcChecksum();
+
+	//Countdown timer and daily alarm. Setting alertPending makes goSleepUntilButton return.
+	if(countdownArmed && (rtcTicks == countdownTarget)) {
+		countdownArmed = false;
+		alertPending = true;
+	}
+
+	if(alarmArmed && (seconds == 0) && (minutes == alarmMinutes)) {
+		//hours may be 24 until rtcService has run.
+		uint8_t localHours = hours + timezone;
+		while (localHours >= 24)
+			localHours -= 24;
+		if (localHours == alarmHours)
+			alertPending = true;
+	}
+
+	//Time for a battery sample? This is taken by goSleepUntilButton, not here, as it takes a few ms.
+	if(++healthTicks >= HEALTH_SAMPLE_INTERVAL) {
+		healthTicks = 0;
+		healthSampleDue = true;
+	}
+
+}
+
+//The calendar half of the RTC - day/month/year rollover and the BST switch. The RTC interrupt asks for
+//this when the hour changes, and it is run from the main loop, with interrupts enabled, whether we're
+//awake (uiWaitEvent) or asleep (goSleepUntilButton). Anything that reads the date should call it first.
+void rtcService() {
 
+	rtcCalendarPending = false;
 
+	//The interrupt may be changing hours, so take the new day out of it atomically.
+	uint8_t oldSREG = SREG;
+	cli();
+	boolean newDay = false;
+	while (hours >= 24) {
+		hours -= 24;
+		newDay = true;
+	}
+	uint8_t h = hours;
+	SREG = oldSREG;
+
+	//Write down the new date (and timezone) at the end, so that a flat battery doesn't set us back more than a day.
+	boolean save = newDay;
 
-	if (hours == 24) {
+	if (newDay) {
 		//Advance once a day.
-		hours = 0;
 		day++;
 
 		if (day > daysInMonth(year, month)) {
@@ -903,26 +2118,181 @@ SIGNAL(TIMER2_OVF_vect){
 			}
 
 		}
-
-
 	}
 
-
 	//BST begins at 01:00 GMT on the last Sunday of March and ends at 01:00 GMT on the last Sunday of October
 
 	//Fire at 1AM on Sundays
-	if ((seconds == 0) && (minutes == 0) && (hours == 1) && (dayOfWeek(year, month, day) == Sunday)) {
+	if ((h == 1) && (dayOfWeek(year, month, day) == Sunday)) {
 		if((month == 3) && ((day+7)>31)){
 			//If it's the last Sunday of the month we're entering BST
 			timezone = 1;
+			save = true;
 		}
 		else
 			if((month == 10) && ((day+7)>31)){
 				//If it's the last Sunday of the month we're leaving BST
 				timezone = 0;
+				save = true;
 			}
 	}
 
+	oldSREG = SREG;
+	cli();
+	rtcCheck = rtcChecksum();
+	SREG = oldSREG;
+
+	if (save)
+		settingsSaveTime();
+
+}
+
+//Take a consistent copy of the time and date. The calendar is brought up to date first.
+void rtcSnapshot(DateTime *t) {
+
+	if(rtcCalendarPending)
+		rtcService();
+
+	uint8_t oldSREG = SREG;
+	cli();
+	t->hours = hours;
+	t->minutes = minutes;
+	t->seconds = seconds;
+	t->day = day;
+	t->month = month;
+	t->year = year;
+	t->timezone = timezone;
+	SREG = oldSREG;
+
+}
+
+//Set the time and date, all at once.
+void rtcCommit(const DateTime *t) {
+
+	uint8_t oldSREG = SREG;
+	cli();
+	hours = t->hours;
+	minutes = t->minutes;
+	seconds = t->seconds;
+	day = t->day;
+	month = t->month;
+	year = t->year;
+	timezone = t->timezone;
+	rtcCalendarPending = false;
+	rtcCheck = rtcChecksum();
+	SREG = oldSREG;
+
+}
+
+//Checksum of the time and date. Call with interrupts disabled (or from the RTC interrupt).
+uint8_t rtcChecksum() {
+	return ~(uint8_t)(hours + minutes + seconds + day + month + year + (year >> 8) + timezone);
+}
+
+//Called at startup. If the time and date survived a reset, carry on from them. Otherwise (after power-up, or
+//a battery change) go back to the last time and date saved in EEPROM, which will be out, but not by years.
+void rtcRestore() {
+
+	if((rtcCheck == rtcChecksum()) && (hours < 24) && (minutes < 60) && (seconds < 60) && (timezone <= 1)
+			&& dateExists(year, month, day)) {
+#ifdef DEBUG_SERIAL
+		Serial.println("Time kept through reset");
+#endif
+		return;
+	}
+
+	rtcCommit(&settings.lastKnown);
+#ifdef DEBUG_SERIAL
+	Serial.println("Time restored from EEPROM");
+#endif
+
+}
+
+//Add up some bytes, for the checksums of things kept through a reset or in EEPROM.
+uint8_t checksum(const void *p, uint8_t len, uint8_t sum) {
+	const uint8_t *b = (const uint8_t *) p;
+	while(len--)
+		sum += *b++;
+	return sum;
+}
+
+uint8_t settingsChecksum(const Settings *s) {
+	return ~checksum(s, offsetof(Settings, check), 0);
+}
+
+//Find the newest valid settings slot in EEPROM. If there isn't one, use the defaults.
+void settingsLoad() {
+
+	boolean found = false;
+	Settings s;
+
+	for(uint8_t i=0;i<SETTINGS_SLOTS;i++) {
+		eeprom_read_block(&s, &settingsStore[i], sizeof(Settings));
+
+		if((s.version != SETTINGS_VERSION) || (s.check != settingsChecksum(&s)))
+			continue;
+
+		//The sequence number wraps, but the slots are never more than SETTINGS_SLOTS apart.
+		if(!found || ((int8_t)(s.sequence - settings.sequence) > 0)) {
+			settings = s;
+			settingsSlot = i;
+			found = true;
+		}
+	}
+
+	if(!found) {
+		settings = settingsDefault;
+		settingsSlot = SETTINGS_SLOTS - 1;
+#ifdef DEBUG_SERIAL
+		Serial.println("No settings in EEPROM, using defaults");
+#endif
+	}
+
+}
+
+//Write the settings into the next slot. Each write takes about 3.4ms per byte that changed.
+void settingsSave() {
+
+	settings.version = SETTINGS_VERSION;
+	settings.sequence++;
+	settings.check = settingsChecksum(&settings);
+
+	settingsSlot = (settingsSlot + 1) % SETTINGS_SLOTS;
+	eeprom_update_block(&settings, &settingsStore[settingsSlot], sizeof(Settings));
+
+}
+
+//Save the current time and date, along with the rest of the settings.
+void settingsSaveTime() {
+	rtcSnapshot(&settings.lastKnown);
+	settingsSave();
+}
+
+//Whole seconds since power-up, all 32 bits - for comparing with rtcTicks, as the countdown timer does.
+uint32_t rtcSeconds() {
+	uint8_t oldSREG = SREG;
+	cli();
+	uint32_t secs = rtcTicks;
+	SREG = oldSREG;
+	return secs;
+}
+
+//Read the RTC with 1/256s resolution - whole seconds in the upper 24 bits, TCNT2 in the lower 8.
+//This wraps after about 194 days, so only use it for differences.
+//Note that TCNT2 may read one count behind for the first 1/32768s after waking from power-save.
+uint32_t rtcNow256() {
+	uint8_t oldSREG = SREG;
+	cli();
+
+	uint8_t sub = TCNT2;
+	uint32_t secs = rtcTicks;
+
+	//If TCNT2 has just wrapped but the interrupt hasn't run yet (because we disabled them), count the pending second.
+	if((TIFR2 & (1<<TOV2)) && (sub < 128))
+		secs++;
+
+	SREG = oldSREG;
+	return (secs << 8) | sub;
 }
 
 //This interrupt occurs when you push the CE button
@@ -933,13 +2303,31 @@ SIGNAL(INT0_vect) {
 
 //This interrupt (overflow) should happen once every few milliseconds, when the fast timer overflows
 //Display update - works with an even brightness.
+//The reload is added to what timer 1 has counted since the overflow, first thing, so that the time the interrupt
+//takes to get here and to run doesn't lengthen the period. It's a fixed number of cycles, so it would be longer
+//in real time at the slow clock than the fast one, and the refresh, the brightness and the timebase would all change
+//with clockSet. (Only the few cycles between reading TCNT1 and writing it back are lost, at any clock.)
 SIGNAL(TIMER1_OVF_vect) {
+	TCNT1 += displayReload;
 	updateDisplay();
-	TCNT1 = PWM_TIME;
+	if(!(++timebaseTicks & 1))
+		timebaseMs++;
+
+	if(latencyDrawn) {
+		latencyDrawn = false;
+		latencyRecord(timebaseTicks - latencyKeyTicks);
+	}
+
+	//Time to start reading the keypad again? The ADC interrupt picks up the result.
+	if((++keypadTicks >= KEY_POLL_TICKS) && !keypadPaused) {
+		keypadTicks = 0;
+		keypadSampling = true;
+		ADMUX = _BV(REFS0) | (btnsA - A0); //AVcc reference
+		ADCSRA |= _BV(ADIE) | _BV(ADSC);
+	}
 }
 
 
-//TODO Brightness control
 //This interrupt should be FAST.
 //(if this consumes more than a few hundred cycles, it's using too many. This runs every 4000 cycles so it shouldn't take more than 400 or so.
 //OR we could nest an interrupt, at the risk of making things VERY messy...
@@ -955,10 +2343,61 @@ void updateDisplay() {
 		digitalWrite(segs[s], ((segstates[onDisplay] & (1 << s))?SEGMENT_ON:SEGMENT_OFF));
 	}
 
-	digitalWrite(cols[onDisplay],COLUMN_ON);
+	digitalWrite(cols[onDisplay],COLUMN_ON);
+
+}
+
+//Part way through each digit's turn, when the display is dimmed - turn it off until the next one.
+SIGNAL(TIMER1_COMPA_vect) {
+	digitalWrite(cols[onDisplay], COLUMN_OFF);
+}
+
+//Set how long each digit is lit for, out of 255.
+void displaySetDuty(uint8_t duty) {
+	uint8_t oldSREG = SREG;
+	cli();
+	displayDuty = (duty < DISPLAY_MIN_DUTY) ? DISPLAY_MIN_DUTY : duty;
+	displaySetCompare();
+	SREG = oldSREG;
+}
+
+//Move the compare interrupt to displayDuty of the way through the display period. Timer 1 starts each period
+//from displayReload, so this only needs doing when the duty or the clock changes. Interrupts should be off.
+void displaySetCompare() {
+	if(displayDuty == 255) {
+		TIMSK1 &= ~_BV(OCIE1A);
+		return;
+	}
+	OCR1A = displayReload + (uint16_t) (((65536UL - displayReload) * displayDuty) >> 8);
+	TIFR1 = _BV(OCF1A);
+	TIMSK1 |= _BV(OCIE1A);
+}
+
 
+//Count one key press latency, in half-ms ticks. Called from the display interrupt.
+void latencyRecord(uint32_t ticks) {
+	uint16_t t = (ticks > 0xFFFF) ? 0xFFFF : ticks;
+	uint16_t bucket = t / (LATENCY_BUCKET_MS * 2);
+	if(bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+	latencyHistogram[bucket]++;
+	latencyCount++;
+	latencyTotal += t;
+	if(t > latencyWorst)
+		latencyWorst = t;
 }
 
+//Average key press latency so far, in ms.
+float latencyAverage() {
+	uint8_t oldSREG = SREG;
+	cli();
+	uint32_t total = latencyTotal;
+	uint16_t count = latencyCount;
+	SREG = oldSREG;
+	if(count == 0)
+		return 0;
+	return (float) total / count / 2;
+}
 
 //We have designed the resistor ladder to produce approximately the following ADC values when read:
 //for PinsA
@@ -975,14 +2414,8 @@ void updateDisplay() {
 static const Keys keymap[] = {
 		KEY_7, KEY_4, KEY_1, KEY_0, KEY_8, KEY_5, KEY_2, KEY_DP, KEY_9, KEY_6, KEY_3, KEY_EQ, KEY_ADD, KEY_SUB, KEY_MUL, KEY_DIV, NO_KEY};
 
-//Read the value of the keypad
-uint8_t readKeypad(void) {
-	//Switch the ADC on
-
-	//TODO Read the pins until the range is low enough to consider it "settled"? Seems to work OK without.
-	int val = analogRead(btnsA);
-	if (val > (1023-64))
-		val = analogRead(btnsB) + 1024;
+//Find out which key an ADC reading corresponds with. Readings from btnsB have 1024 added.
+uint8_t decodeKeypad(int val) {
 
 	//Find out what key this value corresponds with ie 0-63 is key0, 64-191 is key1, ..
 	uint8_t keycnt = 0;
@@ -993,8 +2426,32 @@ uint8_t readKeypad(void) {
 	}
 
 	return keymap[keycnt];
+}
+
+//A conversion has finished - either a keypad sample, or readVcc, which only needs to be woken up.
+SIGNAL(ADC_vect) {
 
-	//Switch the ADC off to save power.
+	if(!keypadSampling)
+		return;
+	keypadConversions++;
+
+	//TODO Read the pins until the range is low enough to consider it "settled"? Seems to work OK without.
+	int val = ADC;
+	if((ADMUX & 0x0F) == (btnsA - A0)) {
+		//Nothing pressed on the first ladder - try the second one.
+		if (val > (1023-64)) {
+			ADMUX = _BV(REFS0) | (btnsB - A0);
+			ADCSRA |= _BV(ADSC);
+			return;
+		}
+	}
+	else
+		val += 1024;
+
+	keypadSampling = false;
+	keypadSample = decodeKeypad(val);
+	keypadSampleTicks = timebaseTicks;
+	keypadSampleReady = true;
 }
 
 
@@ -1060,6 +2517,11 @@ boolean dateIsValid(int y, int m, int d) {
 		return false;
 	}
 
+	if(d<1) {
+		printf("Day too low %i", d);
+		return false;
+	}
+
 	if(d>daysInMonth(y,m)) {
 		printf("Day too great %i - meant to be %i", d, daysInMonth(y,m));
 		return false;
@@ -1071,6 +2533,11 @@ boolean dateIsValid(int y, int m, int d) {
 	return true;
 }
 
+//The same, without the running commentary - for startup, which shouldn't wait for the serial port.
+boolean dateExists(int y, int m, int d) {
+	return (m >= January) && (m <= December) && (y >= 2000) && (y <= 2099) && (d >= 1) && (d <= daysInMonth(y, m));
+}
+
 //Is the current year a leap year? ie does February have a 29th?
 boolean leapYear(int y) {
 	//Here's the weird set of rules for determining if the year is a leap year...
@@ -1094,11 +2561,57 @@ uint8_t daysInMonth(int y, int m) {
 }
 
 //Account for timezone.
+//Seconds since 1/1/1970 GMT, for the serial protocol. Only the years dateIsValid allows need to work.
+uint32_t epochFromDate(const DateTime *t) {
+
+	uint32_t days = t->day - 1;
+	for(int y=1970;y<t->year;y++)
+		days += leapYear(y) ? 366 : 365;
+	for(int m=January;m<t->month;m++)
+		days += daysInMonth(t->year, m);
+
+	return ((days * 24 + t->hours) * 60 + t->minutes) * 60 + t->seconds;
+
+}
+
+//And back again. The timezone is left alone.
+void dateFromEpoch(uint32_t epoch, DateTime *t) {
+
+	t->seconds = epoch % 60;
+	epoch /= 60;
+	t->minutes = epoch % 60;
+	epoch /= 60;
+	t->hours = epoch % 24;
+	uint32_t days = epoch / 24;
+
+	int y = 1970;
+	while(days >= (leapYear(y) ? 366U : 365U)) {
+		days -= leapYear(y) ? 366 : 365;
+		y++;
+	}
+
+	int m = January;
+	while(days >= daysInMonth(y, m)) {
+		days -= daysInMonth(y, m);
+		m++;
+	}
+
+	t->year = y;
+	t->month = m;
+	t->day = days + 1;
+
+}
+
 void calculateTimezoneCorrection() {
-	tzc_hours = hours + timezone;
-	tzc_day = day;
-	tzc_month = month;
-	tzc_year = year;
+	DateTime now;
+	rtcSnapshot(&now);
+
+	tzc_hours = now.hours + now.timezone;
+	tzc_minutes = now.minutes;
+	tzc_seconds = now.seconds;
+	tzc_day = now.day;
+	tzc_month = now.month;
+	tzc_year = now.year;
 
 	if (tzc_hours >= 24)
 	{
@@ -1132,10 +2645,59 @@ void displayTime() {
 
 	segstates[0] = number[(tzc_hours/10)%10];
 	segstates[1] = number[tzc_hours%10] WITH_DECIMAL_POINT;
-	segstates[2] = number[(minutes/10)%10];
-	segstates[3] = number[minutes%10] WITH_DECIMAL_POINT;
-	segstates[4] = number[(seconds/10)%10];
-	segstates[5] = number[seconds%10];
+	segstates[2] = number[(tzc_minutes/10)%10];
+	segstates[3] = number[tzc_minutes%10] WITH_DECIMAL_POINT;
+	segstates[4] = number[(tzc_seconds/10)%10];
+	segstates[5] = number[tzc_seconds%10];
+
+}
+
+//Display a time of day or a duration as HH.MM.SS
+void displayHms(uint8_t h, uint8_t m, uint8_t sec) {
+
+	segstates[0] = number[(h/10)%10];
+	segstates[1] = number[h%10] WITH_DECIMAL_POINT;
+	segstates[2] = number[(m/10)%10];
+	segstates[3] = number[m%10] WITH_DECIMAL_POINT;
+	segstates[4] = number[(sec/10)%10];
+	segstates[5] = number[sec%10];
+
+}
+
+//Display a battery sample as NN V.VVV - the sample number on the left, the voltage on the right.
+void displayBattery(uint8_t idx, uint16_t mv) {
+
+	segstates[0] = number[(idx/10)%10];
+	segstates[1] = number[idx%10];
+	segstates[2] = number[(mv/1000)%10] WITH_DECIMAL_POINT;
+	segstates[3] = number[(mv/100)%10];
+	segstates[4] = number[(mv/10)%10];
+	segstates[5] = number[mv%10];
+
+}
+
+//Display a stopwatch time (in 1/256s) as MM.SS.cc, or HH.MM.SS once it passes an hour.
+void displayChrono(uint32_t t) {
+
+	uint32_t secs = t >> 8;
+	uint8_t a, b, c;
+
+	if(secs < 3600) {
+		a = secs / 60;
+		b = secs % 60;
+		c = ((t & 0xFF) * 100) >> 8; //Hundredths of a second
+	} else {
+		a = (secs / 3600) % 100;
+		b = (secs / 60) % 60;
+		c = secs % 60;
+	}
+
+	segstates[0] = number[a/10];
+	segstates[1] = number[a%10] WITH_DECIMAL_POINT;
+	segstates[2] = number[b/10];
+	segstates[3] = number[b%10] WITH_DECIMAL_POINT;
+	segstates[4] = number[c/10];
+	segstates[5] = number[c%10];
 
 }
 
@@ -1149,7 +2711,6 @@ void displayInt64(int64_t num) {
 	segstates[3] = 0;
 	segstates[4] = 0;
 	segstates[5] = 0;
-	segstates[6] = 0;
 
 	//Something later on assumes non-zero.
 	if(num == 0) {
@@ -1179,16 +2740,22 @@ void displayInt64(int64_t num) {
 		uint8_t exponent = base10log - 1;
 
 		double floaty = num / (pow (10.0, (uint8_t) exponent)); //Low precision with massive numbers. To be honest, none of this is designed to work with int64
+
+		//Round to the number of digits there's room for. This can carry into the next power of ten - 9999999 is 1.000E7.
+		uint8_t digits = ((exponent > 9) ? 3 : 4) - (negative?1:0);
+		floaty += 0.5 * pow(10.0, 1 - digits);
+		if(floaty >= 10.0) {
+			floaty /= 10.0;
+			exponent++;
+		}
+
 		//Write digits.
-		for(int i=(negative?1:0);i<3;i++) {
+		for(int i=(negative?1:0);i<4;i++) {
 			uint8_t digit = floor(floaty);
 			segstates[i] = number[digit];
 			floaty = floaty - digit;
 			floaty = floaty * 10;
 		}
-		//Final digit needs rounding to the nearest value (for example, if we're left with 1.55 it needs to round to 2
-		uint8_t digit = lround(floaty);
-		segstates[3] = number[digit];
 
 
 
@@ -1227,9 +2794,11 @@ void displayInt64(int64_t num) {
 
 void displayDouble(double num) {
 
+#ifdef DEBUG_SERIAL
 	Serial.print("Displaying double ");
 	Serial.print(num);
 	Serial.print("\n");
+#endif
 	//TODO remove multiple calculations with floating point numbers to improve accuracy of displayed numbers.
 
 	if(num == 0.0)
@@ -1242,15 +2811,17 @@ void displayDouble(double num) {
 	{
 		//Display error since it's NaN
 		displayMessage(MSG_ERROR);
+#ifdef DEBUG_SERIAL
 		Serial.println("NaN");
+#endif
 		return;
 	}
 
 	if(isinf(num))
 	{
-		if (isinf(num) == -1)
+		if (num < 0)
 			displayMessage(MSG_NEGINF);
-		if (isinf(num) == 1)
+		else
 			displayMessage(MSG_POSINF);
 
 		return;
@@ -1264,13 +2835,14 @@ void displayDouble(double num) {
 	segstates[3] = 0;
 	segstates[4] = 0;
 	segstates[5] = 0;
-	segstates[6] = 0;
 
 
 	boolean negative = false;
 	if (num<0) {
 		negative = true;
+#ifdef DEBUG_SERIAL
 		Serial.println("number negative");
+#endif
 		num = num * -1;
 		segstates[0] = 0b01000000; // Minus Sign
 	}
@@ -1280,9 +2852,11 @@ void displayDouble(double num) {
 	//If it's longer than 6 digits, we also need to use E
 	double base10log = log10(num);
 
+#ifdef DEBUG_SERIAL
 	Serial.print("Log10 = ");
 	Serial.print(base10log);
 	Serial.print("\n");
+#endif
 	boolean useExp = false;
 
 	//If less than -3 use exponential notation (e-4...)
@@ -1293,32 +2867,45 @@ void displayDouble(double num) {
 	if(num > (negative?99999:999999))
 		useExp = true;
 
+	//Otherwise round to the last digit there's room for (numbers less than one are shown as 0.xxxxx). This can carry
+	//into another digit - 0.999999 is 1.00000, and 99999.99 is 100000 - which might then not fit either.
+	int numDigitsAboveDP = (base10log < 0) ? 0 : floor(base10log);
+	double rounded = num;
+	if(!useExp) {
+		rounded += 0.5 * pow(10.0, numDigitsAboveDP + 1 - (negative?5:6));
+		if(rounded >= pow(10.0, numDigitsAboveDP + 1))
+			numDigitsAboveDP++;
+		if(numDigitsAboveDP >= (negative?5:6))
+			useExp = true;
+	}
+
 	if(useExp) {
+#ifdef DEBUG_SERIAL
 		Serial.println("Displaying using exp notation");
+#endif
 		//TODO THIS
 		//Display in exp notation
 
 
-		int numDigitsAboveDP = floor(base10log) + 1;
-		Serial.print("nDADP = ");
-		Serial.print(numDigitsAboveDP);
-		Serial.print("\n");
-		//normalise to x.xxxxxx
-		while(numDigitsAboveDP > 1)
-		{
-			numDigitsAboveDP--;
-			num*=0.1;
-		}
+		int exp = floor(base10log);
 
-		while(numDigitsAboveDP < 1)
-		{
-			numDigitsAboveDP++;
-			num*=10;
+		//Normalise to x.xxxxxx in one go - multiplying by 10 over and over again loses precision.
+		num = num / pow(10.0, exp);
+
+		//Round to the number of digits there's room for, which depends on how long the exponent is.
+		//This can carry into the next power of ten - 9.9999E-5 is 1.00E-4.
+		uint8_t digits = ((exp < -9) ? 2 : (((exp > 9) || (exp < 0)) ? 3 : 4)) - (negative?1:0);
+		num += 0.5 * pow(10.0, 1 - digits);
+		if(num >= 10.0) {
+			num /= 10.0;
+			exp++;
 		}
 
+#ifdef DEBUG_SERIAL
 		Serial.print("New Num ");
 		Serial.print(num);
 		Serial.print("\n");
+#endif
 
 
 		for(int i=(negative?1:0);i<4;i++) {
@@ -1329,15 +2916,9 @@ void displayDouble(double num) {
 			num = num - digit;
 			num = num * 10;
 
-			//We can't use the +0.000001 trick here because we might be dealing with very small numbers.
-
 		}
 
 
-
-		int exp = floor(base10log)+1;
-
-
 		if(exp < -9) {
 			//We need to display "E-XX"!
 			segstates[2] = 0b01111001;//E;
@@ -1359,7 +2940,7 @@ void displayDouble(double num) {
 				}
 			} else {
 				segstates[4] = 0b01111001;//E
-				segstates[5] = number[(uint8_t) floor(base10log) + 1];//Careful! Will get too big and start spewing garbage, and fails for -ve
+				segstates[5] = number[exp];
 			}
 		}
 
@@ -1367,54 +2948,38 @@ void displayDouble(double num) {
 
 	}
 	else {
+#ifdef DEBUG_SERIAL
 		Serial.println("Displaying non-exponential number");
-		//Floor rounds down to the nearest integer
-		//-1.5 goes DOWN to -2
-		int numDigitsAboveDP = (floor(base10log));
 		Serial.print("NDADP = ");
 		Serial.print(numDigitsAboveDP);
 		Serial.print("\n");
-		if(numDigitsAboveDP > 0) {//Numbers bigger than 1 need to be normalised
-			int shift = (floor(base10log));
-			//We need to normalise this number, so that it is in the format X.XXXXX (decimal place drawn later)
-
-			while(shift > 0) {
-				num*=0.1;
-				shift--;
-			}
-			while(shift < 0) {
-				num*=10;
-				shift++;
-			}
+#endif
 
-			Serial.print("New Num is ");
-			Serial.print(num);
-			Serial.print("\n");
+		//Normalise to X.XXXXX (the decimal place is drawn later) in one go, as above.
+		num = rounded / pow(10.0, numDigitsAboveDP);
 
-		}
+#ifdef DEBUG_SERIAL
+		Serial.print("New Num is ");
+		Serial.print(num);
+		Serial.print("\n");
+#endif
 
 		//Now print the number, from the format X.XXXXX on the screen
 		for(int i=((negative)?1:0);i<6;i++) {
-			//Digit is just floor(num)
+			//Digit is just floor(num) - which rounding errors could make 10, right at the end
 			uint8_t digit = floor(num);
+			if(digit > 9)
+				digit = 9;
 			segstates[i] = number[digit];
 
 			num = num - digit;
 			num = num * 10;
-			num = num +0.0000001;//Does this help? Yes, seems so.
 
 		}
 
-		//.Add the decimal place.
-		if(base10log < 0)
-			segstates[(negative?1:0)] |= 0b10000000;
-		else
-		{
-			//Display the decimal place in the relevant position, if it isn't the last display
-			if ((uint8_t)floor(base10log)+(negative?1:0) < 5)
-				segstates[(uint8_t)floor(base10log)+(negative?1:0)]|=0b10000000;
-
-		}
+		//Display the decimal place in the relevant position, if it isn't the last display
+		if (numDigitsAboveDP + (negative?1:0) < 5)
+			segstates[numDigitsAboveDP + (negative?1:0)] |= 0b10000000;
 	}
 
 	//TODO Sprintf or fmt_fp (format float point)
@@ -1434,6 +2999,13 @@ Improving Accuracy
  This calibrated value will be good for the AVR chip measured only, and may be subject to temperature variation. Feel free to experiment with your own measurements.
  */
 long readVcc() {
+	//Stop the background keypad sampling, and let any conversion it's doing finish.
+	keypadPaused = true;
+	while(keypadSampling) {
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		sleep_mode();
+	}
+
 	// Read 1.1V reference against AVcc
 	// set the reference to Vcc and the measurement to the internal 1.1V reference
 #if defined(__AVR_ATmega32U4__) || defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
@@ -1446,20 +3018,510 @@ long readVcc() {
 	ADMUX = _BV(REFS0) | _BV(MUX3) | _BV(MUX2) | _BV(MUX1);
 #endif
 
-	_delay_ms(2); // Wait for Vref to settle
-	ADCSRA |= _BV(ADSC); // Start conversion
-	while (bit_is_set(ADCSRA,ADSC)); // measuring
-
-	uint8_t low  = ADCL; // must read ADCL first - it then locks ADCH
-	uint8_t high = ADCH; // unlocks both
+	//Rather than busy-waiting for each conversion, sleep in ADC Noise Reduction mode - this
+	//starts the conversion, and stops the CPU and IO clocks (and their noise) until it completes.
+	//Instead of waiting 2ms for Vref to settle, throw away the first few conversions.
+	ADCSRA |= _BV(ADIE);
+	set_sleep_mode(SLEEP_MODE_ADC);
+
+	uint16_t total = 0;
+	for(uint8_t i=0;i<(VCC_OVERSAMPLE+VCC_DISCARD);i++) {
+		//Other interrupts (such as the display) can wake us early, so go back to sleep until the conversion is done.
+		do {
+			sleep_mode();
+		} while (bit_is_set(ADCSRA,ADSC));
+
+		if(i >= VCC_DISCARD)
+			total += ADC;
+	}
+	adcConversions += VCC_OVERSAMPLE + VCC_DISCARD;
 
-	long result = (high<<8) | low;
+	set_sleep_mode(SLEEP_MODE_PWR_SAVE);
+	ADCSRA &= ~_BV(ADIE);
+	keypadPaused = false;
 
-	//Original constant: 1125300
-	result =  1125300L / result; // Calculate Vcc (in mV); 1125300 = 1.1*1023*1000
+	//Original constant: 1125300, now kept in the settings
+	long result = (settings.vccReference * VCC_OVERSAMPLE) / total; // Calculate Vcc (in mV); 1125300 = 1.1*1023*1000
 	return result; // Vcc in millivolts
 }
 
+//Measure the battery and update the filtered estimate. The display should be blanked first, so that
+//its current draw doesn't pull the reading down.
+uint16_t measureBattery() {
+
+	uint16_t vcc = readVcc();
+
+	//First-order low-pass filter, so a single noisy reading doesn't trigger the low battery warning.
+	if(vccFiltered == 0)
+		vccFiltered = vcc;
+	else
+		vccFiltered = vccFiltered + ((int16_t)(vcc - vccFiltered) / 4);
+
+	return vccFiltered;
+}
+
+//CPU cycles in two steps of TCNT2 (timer 2 counts the crystal, 256 steps a second), counted by timer 1.
+//Returns 0xFFFF if timer 1 overflowed, as it would with the oscillator more than 5% fast.
+uint16_t oscMeasure() {
+
+	uint8_t oldSREG = SREG;
+	cli();
+
+	//Start on a step of TCNT2.
+	uint8_t start = TCNT2;
+	while(TCNT2 == start);
+	TCNT1 = 0;
+	TIFR1 = _BV(TOV1);
+	start++;
+
+	while((uint8_t) (TCNT2 - start) < 2);
+	uint16_t cycles = TCNT1;
+	boolean overflowed = bit_is_set(TIFR1, TOV1);
+
+	SREG = oldSREG;
+	return overflowed ? 0xFFFF : cycles;
+}
+
+//Adjust OSCCAL one step at a time until the CPU clock matches the crystal, and save it along with the battery
+//voltage it was done at. This borrows timer 1 from the display (which should be blanked) for up to about a quarter
+//of a second, usually much less when starting from the last calibration. It stays within OSCCAL's range (the top bit
+//picks one of two overlapping ranges), and only takes small steps, as the datasheet recommends.
+void oscCalibrate(uint16_t vcc) {
+
+	//At the speed the power policy has us run at while awake, with both display interrupts off, to within 0.1%.
+	clockSet(clockAwake);
+	uint16_t target = OSC_TARGET >> clockDiv;
+	uint16_t tolerance = target / 1000;
+	uint8_t oldTimsk1 = TIMSK1;
+	TIMSK1 = 0;
+	uint32_t since = rtcNow256();
+
+#ifdef DEBUG_SERIAL
+	uint8_t was = OSCCAL;
+#endif
+	uint8_t best = OSCCAL;
+	uint16_t bestError = 0xFFFF;
+	int8_t lastStep = 0;
+
+	for(uint8_t i=0;i<OSC_MAX_STEPS;i++) {
+		uint16_t cycles = oscMeasure();
+		uint16_t error = (cycles > target) ? (cycles - target) : (target - cycles);
+		if(error < bestError) {
+			bestError = error;
+			best = OSCCAL;
+		}
+		if(error <= tolerance)
+			break;
+
+		//Too many cycles means the oscillator is fast, so turn it down. Once we've gone past, we're done.
+		int8_t step = (cycles > target) ? -1 : 1;
+		if(step == -lastStep)
+			break;
+		uint8_t next = OSCCAL + step;
+		if((next ^ OSCCAL) & 0x80)
+			break;
+		OSCCAL = next;
+		lastStep = step;
+	}
+	OSCCAL = best;
+
+	//The display interrupt hasn't been counting meanwhile (see goSleepUntilButton).
+	timebaseAdvance(rtcNow256() - since);
+	TCNT1 = displayReload;
+	TIFR1 = _BV(TOV1) | _BV(OCF1A);
+	TIMSK1 = oldTimsk1;
+
+	settings.osccal = best;
+	settings.osccalVcc = vcc;
+	settingsSave();
+
+#ifdef DEBUG_SERIAL
+	printf("OSCCAL %u -> %u at %u mV, %li ppm out\n", was, best, vcc, (long) bestError * 1000000L / target);
+#endif
+
+}
+
+//Take a battery sample from deep sleep, and add it to the history.
+//The display is already off, and the ADC is only powered for the few milliseconds this takes.
+void sampleHealth() {
+
+	healthSampleDue = false;
+
+	power_adc_enable();
+	ADCSRA |= (1<<ADEN);
+
+	vccHistory[vccHistoryHead] = readVcc();
+	vccHistoryHead = (vccHistoryHead + 1) % VCC_HISTORY_LEN;
+	if(vccHistoryCount < VCC_HISTORY_LEN)
+		vccHistoryCount++;
+
+	ADCSRA &= ~(1<<ADEN);
+	power_adc_disable();
+
+}
+
+//Account the time since the last change of power state to that state, then switch to the new one.
+void powerStateEnter(uint8_t state) {
+
+	uint32_t now = rtcNow256();
+	powerTime[powerState] += now - powerStateSince;
+	if(powerState != PWR_SLEEP)
+		displayOnTime += (float) (now - powerStateSince) * displayDuty / 255;
+	powerStateSince = now;
+	powerState = state;
+
+	//And the keypad's ADC conversions. This is called every time we wait for an event, so it can't overflow.
+	uint8_t oldSREG = SREG;
+	cli();
+	adcConversions += keypadConversions;
+	keypadConversions = 0;
+	SREG = oldSREG;
+
+}
+
+//Move to the power level for this battery voltage.
+void powerPolicy(uint16_t vcc) {
+
+	uint8_t level = powerLevel;
+	while((level + 1 < POWER_LEVELS) && (vcc < powerLevels[level + 1].enterMv))
+		level++;
+	while((level > 0) && (vcc > powerLevels[level].leaveMv))
+		level--;
+
+#ifdef DEBUG_SERIAL
+	if(level != powerLevel)
+		printf("Power level %u -> %u at %u mV\n", powerLevel, level, vcc);
+#endif
+
+	powerLevel = level;
+	powerApply();
+
+}
+
+//Set the display brightness and the CPU clock for the current power level.
+void powerApply() {
+	displaySetDuty((uint16_t) settings.brightness * powerLevels[powerLevel].brightness / 255);
+	clockAwake = powerLevels[powerLevel].clockAwake;
+	clockSet(clockAwake);
+}
+
+//A mode's timeout, shortened for the current power level.
+uint16_t powerTimeout(uint16_t ms) {
+	return (uint32_t) ms * powerLevels[powerLevel].timeoutPercent / 100;
+}
+
+//Average supply current since power-up, in microamps, from the time spent in each state.
+float powerAverageCurrent() {
+
+	float charge = 0; //uA * 1/256s
+	float time = 0;
+
+	for(uint8_t i=0;i<NUM_PWR_STATES;i++) {
+		charge += (float) powerTime[i] * powerStateCurrent[i];
+		time += powerTime[i];
+	}
+
+	charge += displayOnTime * DISPLAY_CURRENT;
+	charge += (float) adcConversions * ADC_CONVERSION_US * 256 / 1000000 * ADC_CURRENT;
+
+	if(time == 0)
+		return powerStateCurrent[PWR_AWAKE] + DISPLAY_CURRENT;
+	return charge / time;
+}
+
+#ifdef __AVR__
+
+//From the linker: the end of .data, .bss and .noinit, where the heap would start (we don't use one).
+extern uint8_t __data_start;
+extern uint8_t _end;
+
+//Paint the stack before anything has used it. This runs in .init3, after the stack pointer has been set up
+//but before the variables are, so it can't use any of them (or call anything).
+void stackPaint() __attribute__ ((naked, used, section (".init3")));
+void stackPaint() {
+	uint8_t *p = &_end;
+	while(p <= (uint8_t *) RAMEND)
+		*p++ = STACK_CANARY;
+}
+
+//The most stack used since it was last painted, in bytes.
+uint16_t stackHighWater() {
+	uint8_t *p = &_end;
+	while((p <= (uint8_t *) RAMEND) && (*p == STACK_CANARY))
+		p++;
+	return (uint8_t *) RAMEND + 1 - p;
+}
+
+//Paint the stack below where it is now, to start a new high-water mark. The interrupts are off so that
+//none of them push anything there while we're painting it.
+void stackRepaint() {
+	uint8_t oldSREG = SREG;
+	cli();
+	uint8_t *p = &_end;
+	while(p < (uint8_t *) SP)
+		*p++ = STACK_CANARY;
+	SREG = oldSREG;
+}
+
+//Bytes of RAM used by variables (.data, .bss and .noinit).
+uint16_t ramStatic() {
+	return &_end - &__data_start;
+}
+
+#else
+
+//The emulator runs on the host's stack, so there's nothing to measure.
+uint16_t stackHighWater() { return 0; }
+void stackRepaint() {}
+uint16_t ramStatic() { return 0; }
+
+#endif
+
+//Bytes of RAM the stack has never reached, at its worst.
+uint16_t ramSpare() {
+	return (RAMEND + 1 - RAMSTART) - ramStatic() - stackPeak;
+}
+
+#ifdef DEBUG_SERIAL
+void printRamReport() {
+
+#ifdef __AVR__
+	printf("RAM: %u bytes of variables, stack worst %u, %u spare\n", ramStatic(), stackPeak, ramSpare());
+	for(uint8_t i=0;i<NUM_MODES;i++)
+		if(modeStackPeak[i])
+			printf("Mode %i: stack %u\n", i, modeStackPeak[i]);
+	if(ramSpare() < STACK_MARGIN)
+		printf("RAM: stack within %u bytes of the variables!\n", STACK_MARGIN);
+#endif
+
+}
+
+void printPowerReport() {
+
+	powerStateEnter(powerState);
+
+	printf("Power: asleep %lus, awake %lus, %lu ADC conversions, level %u\n", powerTime[PWR_SLEEP] >> 8, powerTime[PWR_AWAKE] >> 8, adcConversions, powerLevel);
+	for(uint8_t i=0;i<NUM_MODES;i++)
+		printf("Mode %i: %lus\n", i, modeTime[i] >> 8);
+
+	float current = powerAverageCurrent();
+	printf("Average %li nA, projected battery life %li days\n", lround(current * 1000), lround(BATTERY_CAPACITY_UAH / current / 24));
+
+}
+
+void printLatencyReport() {
+
+	//Take a copy, as the display interrupt adds to it.
+	uint16_t histogram[LATENCY_BUCKETS];
+	uint8_t oldSREG = SREG;
+	cli();
+	for(uint8_t i=0;i<LATENCY_BUCKETS;i++)
+		histogram[i] = latencyHistogram[i];
+	uint16_t count = latencyCount;
+	uint16_t worst = latencyWorst;
+	SREG = oldSREG;
+
+	if(count == 0)
+		return;
+
+	printf("Key latency: %u presses, average %li us, worst %li us\n", count, lround(latencyAverage() * 1000), (long) worst * 500);
+	for(uint8_t i=0;i<LATENCY_BUCKETS;i++) {
+		if(histogram[i] == 0)
+			continue;
+		if(i == LATENCY_BUCKETS - 1)
+			printf("  %2i ms+    %u\n", i * LATENCY_BUCKET_MS, histogram[i]);
+		else
+			printf("  %2i-%2i ms  %u\n", i * LATENCY_BUCKET_MS, (i + 1) * LATENCY_BUCKET_MS, histogram[i]);
+	}
+
+}
+#endif
+
+//Take one byte received on the serial port (see PROTO_SYNC for the frame format). Once it completes a frame with a
+//good check byte, the command is carried out and answered, and this returns true.
+boolean protoReceive(uint8_t c, unsigned long now) {
+
+	if((protoStage != PROTO_WAIT_SYNC) && ((now - protoLastByte) > PROTO_FRAME_MS))
+		protoStage = PROTO_WAIT_SYNC;
+	protoLastByte = now;
+
+	switch(protoStage) {
+	case PROTO_WAIT_SYNC:
+		if(c == PROTO_SYNC)
+			protoStage = PROTO_WAIT_COMMAND;
+		break;
+
+	case PROTO_WAIT_COMMAND:
+		if(c == PROTO_SYNC)
+			break;
+		protoCommand = c;
+		protoStage = PROTO_WAIT_LENGTH;
+		break;
+
+	case PROTO_WAIT_LENGTH:
+		protoLength = c;
+		protoReceived = 0;
+		if(c > PROTO_MAX_PAYLOAD)
+			protoStage = PROTO_WAIT_SYNC;
+		else
+			protoStage = c ? PROTO_WAIT_PAYLOAD : PROTO_WAIT_CHECK;
+		break;
+
+	case PROTO_WAIT_PAYLOAD:
+		protoPayload[protoReceived++] = c;
+		if(protoReceived == protoLength)
+			protoStage = PROTO_WAIT_CHECK;
+		break;
+
+	case PROTO_WAIT_CHECK:
+		protoStage = PROTO_WAIT_SYNC;
+		if(c != (uint8_t) ~checksum(protoPayload, protoLength, protoCommand + protoLength))
+			break;
+		protoHandle();
+		return true;
+	}
+
+	return false;
+
+}
+
+//Is a frame coming in, or a reply still going out? If so the clock (and so the baud rate) mustn't change.
+//This also gives up on a frame that has stopped part way, so as not to hold the clock up for ever.
+boolean protoBusy(unsigned long now) {
+
+	if((protoStage != PROTO_WAIT_SYNC) && ((now - protoLastByte) > PROTO_FRAME_MS))
+		protoStage = PROTO_WAIT_SYNC;
+
+	//The Arduino core and hal.h both clear TXC0 as they write each byte, and it's set once the last one has gone.
+	//(The core's buffer also has UDRIE0 set while there's anything in it.) TXC0 is clear before anything has been
+	//sent at all too, but setup always prints something.
+	boolean sending = (UCSR0B & _BV(UDRIE0)) || !(UCSR0A & _BV(TXC0));
+
+	return (protoStage != PROTO_WAIT_SYNC) || Serial.available() || sending;
+
+}
+
+//Carry out the command in protoCommand and protoPayload, and send the reply.
+void protoHandle() {
+
+	const uint8_t expected[] = {0, 0, 5, 0, 0, 0};
+	if((protoCommand < PROTO_PING) || (protoCommand > PROTO_COUNTERS)) {
+		protoError(protoCommand, PROTO_ERR_COMMAND);
+		return;
+	}
+	if(protoLength != expected[protoCommand]) {
+		protoError(protoCommand, PROTO_ERR_LENGTH);
+		return;
+	}
+
+	switch(protoCommand) {
+	case PROTO_PING: {
+		uint8_t version = PROTO_VERSION;
+		protoStart(PROTO_PING, 1);
+		protoSend(&version, 1);
+		break;
+	}
+
+	case PROTO_SET_TIME: {
+		//This sets the time to the second - TCNT2 carries on from wherever it had got to.
+		uint32_t epoch = protoPayload[0] | ((uint16_t) protoPayload[1] << 8) | ((uint32_t) protoPayload[2] << 16) | ((uint32_t) protoPayload[3] << 24);
+		DateTime t;
+		dateFromEpoch(epoch, &t);
+		t.timezone = protoPayload[4];
+		if(t.timezone == PROTO_TZ_AUTO)
+			t.timezone = inBst(t.year, t.month, t.day) ? 1 : 0;
+		if((t.timezone > 1) || !dateIsValid(t.year, t.month, t.day)) {
+			protoError(PROTO_SET_TIME, PROTO_ERR_VALUE);
+			return;
+		}
+		rtcCommit(&t);
+		settingsSaveTime();
+		protoStart(PROTO_SET_TIME, 0);
+		break;
+	}
+
+	case PROTO_STATE: {
+		DateTime t;
+		rtcSnapshot(&t);
+		uint32_t epoch = epochFromDate(&t);
+		uint8_t oldSREG = SREG;
+		cli();
+		uint32_t uptime = rtcTicks;
+		SREG = oldSREG;
+		uint8_t osccal = OSCCAL;
+		protoStart(PROTO_STATE, 14);
+		protoSend(&epoch, 4);
+		protoSend(&t.timezone, 1);
+		protoSend(&uptime, 4);
+		protoSend(&vccFiltered, 2);
+		protoSend(&powerLevel, 1);
+		protoSend(&settings.brightness, 1);
+		protoSend(&osccal, 1);
+		break;
+	}
+
+	case PROTO_BATTERY: {
+		protoStart(PROTO_BATTERY, 1 + vccHistoryCount * 2);
+		protoSend(&vccHistoryCount, 1);
+		for(uint8_t i=0;i<vccHistoryCount;i++)
+			protoSend(&vccHistory[(vccHistoryHead + VCC_HISTORY_LEN - vccHistoryCount + i) % VCC_HISTORY_LEN], 2);
+		break;
+	}
+
+	case PROTO_COUNTERS: {
+		//Bring the time in the current power state up to date, and take a copy of what the display interrupt counts.
+		powerStateEnter(powerState);
+		uint8_t oldSREG = SREG;
+		cli();
+		uint16_t count = latencyCount;
+		uint16_t worst = latencyWorst;
+		SREG = oldSREG;
+		uint8_t modes = NUM_MODES;
+		protoStart(PROTO_COUNTERS, 1 + sizeof(powerTime) + 4 + sizeof(modeTime) + 6);
+		protoSend(&modes, 1);
+		protoSend(powerTime, sizeof(powerTime));
+		protoSend(&adcConversions, 4);
+		protoSend(modeTime, sizeof(modeTime));
+		protoSend(&count, 2);
+		protoSend(&worst, 2);
+		protoSend(&stackPeak, 2);
+		break;
+	}
+	}
+
+	protoEnd();
+
+}
+
+//Send a reply: protoStart, then the payload (length bytes in all) with protoSend, then protoEnd.
+//The AVR is little-endian, so variables can be sent as they are.
+void protoStart(uint8_t command, uint8_t length) {
+	Serial.write(PROTO_SYNC);
+	Serial.write(command | PROTO_REPLY);
+	Serial.write(length);
+	protoSum = (command | PROTO_REPLY) + length;
+}
+
+void protoSend(const void *p, uint8_t length) {
+	const uint8_t *b = (const uint8_t *) p;
+	protoSum = checksum(p, length, protoSum);
+	while(length--)
+		Serial.write(*b++);
+}
+
+void protoEnd() {
+	Serial.write((uint8_t) ~protoSum);
+}
+
+void protoError(uint8_t command, uint8_t error) {
+	Serial.write(PROTO_SYNC);
+	Serial.write(PROTO_ERROR);
+	Serial.write(2);
+	Serial.write(command);
+	Serial.write(error);
+	Serial.write((uint8_t) ~(PROTO_ERROR + 2 + command + error));
+}
+
 //Go to sleep (low power) and don't leave this function intil the C/CE/ON button  is pressed.
 void goSleepUntilButton() {
 
@@ -1471,9 +3533,6 @@ void goSleepUntilButton() {
 
 	power_timer1_disable();
 
-	//Switch timer0 off
-	power_timer0_disable();
-
 	//Switch the segments off
 	//All inputs, no pullups
 	for(uint8_t i=0;i<8;i++){
@@ -1486,8 +3545,9 @@ void goSleepUntilButton() {
 	}
 
 
-	//Switch ADC off
+	//Switch ADC off, abandoning any keypad sample in progress
 	ADCSRA &= ~(1<<ADEN); //Disable ADC
+	keypadSampling = false;
 	ACSR = (1<<ACD); //Disable the analog comparator
 	DIDR0 = 0x3F; //Disable digital input buffers on all ADC0-ADC5 pins
 	DIDR1 = (1<<AIN1D)|(1<<AIN0D); //Disable digital input buffer on AIN1/0
@@ -1497,11 +3557,30 @@ void goSleepUntilButton() {
 
 	button_pressed = false;
 
-	while (!button_pressed)
+	set_sleep_mode(SLEEP_MODE_PWR_SAVE);
+	powerStateEnter(PWR_SLEEP);
+	uint32_t asleepSince = rtcNow256();
+
+	//The countdown timer and alarm are checked in the RTC interrupt, which wakes us once a second anyway.
+	//The USART stops in power-save, so let whatever has been printed (such as the reports) go first.
+	while (!button_pressed && !alertPending) {
+		Serial.flush();
 		sleep_mode();
 
-	//This point will be reached only after the button has been pressed - now we need to wake up again.
+		if(rtcCalendarPending)
+			rtcService();
+
+		if(healthSampleDue)
+			sampleHealth();
+	}
+
+	//This point will be reached only after the button has been pressed (or an alert is due) - now we need to wake up again.
 	sleep_disable();
+	powerStateEnter(PWR_AWAKE);
+
+	//The display interrupt hasn't been counting, so move the timebase on by however long we were asleep.
+	//(No need to turn interrupts off - timer1 is still stopped.)
+	timebaseAdvance(rtcNow256() - asleepSince);
 
 
 
@@ -1522,9 +3601,6 @@ void goSleepUntilButton() {
 	power_timer1_enable();
 	TCCR1B |= (1 << CS10);
 
-
-	power_timer0_enable();
-
 	power_adc_enable();
 
 	ADCSRA |= (1 << ADEN); //Enable ADC
@@ -1555,3 +3631,13 @@ void unblankDisplay() {
 
 }
 
+#if !defined(ARDUINO) && !defined(NO_MAIN)
+//Without the Arduino core, we need our own main - the same as Arduino's, less the parts we don't use.
+//(NO_MAIN is for programs that include this file for its functions, such as bench/cycles.cpp.)
+int main() {
+	halInit();
+	setup();
+	for(;;)
+		loop();
+}
+#endif
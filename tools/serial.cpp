@@ -0,0 +1,248 @@
+/*
+ Calcuclock serial client
+
+ Talks to the firmware's serial protocol (see PROTO_SYNC in source.c) through a USB serial adapter, or the
+ emulator's pseudo-terminal (emulator -p). The Calcuclock only listens while it's awake, so press C/CE/ON first -
+ each command keeps it awake for as long as a key press would.
+
+ Usage: calcuclock-serial port command
+
+  ping                  check it's there, and print the protocol version
+  settime [epoch] [tz]  set the time: epoch in seconds since 1970 GMT (default now), tz 0 for GMT, 1 for BST or
+                        auto (the default) to work it out from the date
+  state                 print the time, battery voltage, power level, brightness and oscillator calibration
+  battery               print the battery history, oldest first
+  counters              print the power, mode, key latency and stack counters
+
+ Each frame is sent after a PROTO_SYNC on its own, which gives the Calcuclock time to switch to its full clock
+ speed (and baud rate) for the rest. A command that gets no reply (a frame lost, or the Calcuclock asleep) is sent
+ again, a few times. Anything else the firmware sends, such as its debug text, is skipped over.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/select.h>
+
+#include <vector>
+
+//These must match source.c.
+#define PROTO_SYNC 0x7E
+#define PROTO_REPLY 0x80
+#define PROTO_ERROR 0xFF
+#define PROTO_TZ_AUTO 0xFF
+#define PROTO_WAKE_MS 20
+
+enum ProtoCommands {
+	PROTO_PING = 1,
+	PROTO_SET_TIME,
+	PROTO_STATE,
+	PROTO_BATTERY,
+	PROTO_COUNTERS
+};
+
+static const char *protoErrors[] = {"", "unknown command", "wrong length", "out of range"};
+
+#define ATTEMPTS 3
+#define REPLY_TIMEOUT_MS 1000
+
+static int port = -1;
+
+static int serialOpen(const char *path) {
+	int fd = open(path, O_RDWR | O_NOCTTY);
+	if(fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	struct termios t;
+	if(tcgetattr(fd, &t) == 0) {
+		cfmakeraw(&t);
+		cfsetispeed(&t, B9600);
+		cfsetospeed(&t, B9600);
+		t.c_cflag |= CLOCAL | CREAD;
+		tcsetattr(fd, TCSANOW, &t);
+	}
+	//Throw away whatever was sent before we got here.
+	tcflush(fd, TCIFLUSH);
+	return fd;
+}
+
+//Read what arrives within ms milliseconds (or less, if something does), adding it to buf. False on a timeout.
+static bool serialRead(std::vector<uint8_t> &buf, int ms) {
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(port, &fds);
+	struct timeval t = {ms / 1000, (ms % 1000) * 1000};
+	if(select(port + 1, &fds, 0, 0, &t) <= 0)
+		return false;
+	uint8_t b[256];
+	ssize_t n = read(port, b, sizeof(b));
+	if(n <= 0)
+		return false;
+	buf.insert(buf.end(), b, b + n);
+	return true;
+}
+
+static uint64_t millis() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000ULL + t.tv_nsec / 1000000;
+}
+
+//Look for a good frame at the start of buf. Returns its length, 0 if more is needed, or -1 if buf doesn't start
+//with one (so skip a byte and look again).
+static int frameAt(const std::vector<uint8_t> &buf) {
+	if(buf[0] != PROTO_SYNC)
+		return -1;
+	if(buf.size() < 3)
+		return 0;
+	size_t length = buf[2];
+	if(buf.size() < length + 4)
+		return 0;
+	uint8_t sum = 0;
+	for(size_t i=1;i<length+3;i++)
+		sum += buf[i];
+	return ((uint8_t) ~sum == buf[length + 3]) ? (int) length + 4 : -1;
+}
+
+//Send a command, and wait for its reply (or an error). The reply's payload goes in reply.
+static bool command(uint8_t cmd, const uint8_t *payload, uint8_t length, std::vector<uint8_t> &reply) {
+
+	std::vector<uint8_t> frame;
+	frame.push_back(PROTO_SYNC);
+	frame.push_back(cmd);
+	frame.push_back(length);
+	frame.insert(frame.end(), payload, payload + length);
+	uint8_t sum = 0;
+	for(size_t i=1;i<frame.size();i++)
+		sum += frame[i];
+	frame.push_back(~sum);
+
+	for(int attempt=0;attempt<ATTEMPTS;attempt++) {
+		uint8_t wake = PROTO_SYNC;
+		if(write(port, &wake, 1) != 1) {
+			perror("write");
+			return false;
+		}
+		tcdrain(port);
+		usleep(PROTO_WAKE_MS * 1000);
+		if(write(port, &frame[0], frame.size()) != (ssize_t) frame.size()) {
+			perror("write");
+			return false;
+		}
+
+		std::vector<uint8_t> buf;
+		uint64_t until = millis() + REPLY_TIMEOUT_MS;
+		while(millis() < until) {
+			serialRead(buf, until - millis());
+			while(!buf.empty()) {
+				int n = frameAt(buf);
+				if(n == 0)
+					break;
+				if(n < 0) {
+					buf.erase(buf.begin());
+					continue;
+				}
+				uint8_t got = buf[1];
+				if((got == PROTO_ERROR) && (buf[2] == 2) && (buf[3] == cmd)) {
+					uint8_t error = buf[4];
+					fprintf(stderr, "Error: %s\n", (error < sizeof(protoErrors) / sizeof(protoErrors[0])) ? protoErrors[error] : "unknown");
+					return false;
+				}
+				if(got == (cmd | PROTO_REPLY)) {
+					reply.assign(buf.begin() + 3, buf.begin() + n - 1);
+					return true;
+				}
+				buf.erase(buf.begin(), buf.begin() + n);
+			}
+		}
+	}
+
+	fprintf(stderr, "No reply - is it awake? (Press C/CE/ON.)\n");
+	return false;
+
+}
+
+static uint32_t get(const std::vector<uint8_t> &b, size_t at, int bytes) {
+	uint32_t v = 0;
+	for(int i=bytes-1;i>=0;i--)
+		v = (v << 8) | b[at + i];
+	return v;
+}
+
+static void printEpoch(uint32_t epoch) {
+	time_t t = epoch;
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	printf("%02d:%02d:%02d %02d/%02d/%04d GMT", tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_mday, tm.tm_mon + 1, tm.tm_year + 1900);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s port ping|settime [epoch] [0|1|auto]|state|battery|counters\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+
+	if(argc < 3)
+		usage(argv[0]);
+	port = serialOpen(argv[1]);
+	const char *what = argv[2];
+	std::vector<uint8_t> r;
+
+	if(!strcmp(what, "ping")) {
+		if(!command(PROTO_PING, 0, 0, r) || (r.size() != 1))
+			return 1;
+		printf("Protocol version %u\n", r[0]);
+	}
+	else if(!strcmp(what, "settime")) {
+		uint32_t epoch = (argc > 3) ? strtoul(argv[3], 0, 0) : time(0);
+		uint8_t tz = PROTO_TZ_AUTO;
+		if((argc > 4) && strcmp(argv[4], "auto"))
+			tz = atoi(argv[4]);
+		uint8_t p[5] = {(uint8_t) epoch, (uint8_t) (epoch >> 8), (uint8_t) (epoch >> 16), (uint8_t) (epoch >> 24), tz};
+		if(!command(PROTO_SET_TIME, p, sizeof(p), r))
+			return 1;
+		printf("Set to ");
+		printEpoch(epoch);
+		printf("\n");
+	}
+	else if(!strcmp(what, "state")) {
+		if(!command(PROTO_STATE, 0, 0, r) || (r.size() != 14))
+			return 1;
+		printf("Time: ");
+		printEpoch(get(r, 0, 4));
+		printf(" (epoch %u), %s\n", get(r, 0, 4), r[4] ? "BST" : "GMT");
+		printf("Up: %us\n", get(r, 5, 4));
+		printf("Battery: %u mV, power level %u\n", get(r, 9, 2), r[11]);
+		printf("Brightness: %u, OSCCAL: 0x%02X\n", r[12], r[13]);
+	}
+	else if(!strcmp(what, "battery")) {
+		if(!command(PROTO_BATTERY, 0, 0, r) || r.empty() || (r.size() != 1U + r[0] * 2))
+			return 1;
+		printf("%u samples, 6 hours apart, oldest first\n", r[0]);
+		for(int i=0;i<r[0];i++)
+			printf("%u mV\n", get(r, 1 + i * 2, 2));
+	}
+	else if(!strcmp(what, "counters")) {
+		if(!command(PROTO_COUNTERS, 0, 0, r) || r.empty() || (r.size() != 1U + 16 + r[0] * 4 + 6))
+			return 1;
+		uint8_t modes = r[0];
+		printf("Asleep %us, awake %us, idle %us, %u ADC conversions\n", get(r, 1, 4) >> 8, get(r, 5, 4) >> 8, get(r, 9, 4) >> 8, get(r, 13, 4));
+		for(int i=0;i<modes;i++)
+			printf("Mode %d: %us\n", i, get(r, 17 + i * 4, 4) >> 8);
+		size_t at = 17 + modes * 4;
+		printf("Key latency: %u presses, worst %u us\n", get(r, at, 2), get(r, at + 2, 2) * 500);
+		printf("Stack: %u bytes at most\n", get(r, at + 4, 2));
+	}
+	else
+		usage(argv[0]);
+
+	return 0;
+}
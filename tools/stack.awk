@@ -0,0 +1,186 @@
+# Worst-case stack use of an AVR program, worked out from its disassembly:
+#
+#  avr-objdump -dC build/calcuclock.elf | awk -v indirect='^fputc$=uart_putchar[(];=Handler[(]' -f tools/stack.awk
+#
+# A function's own use is its return address, the registers it saves and the frame it sets aside, all read from
+# its prologue, plus anything it pushes before a call (printf's arguments, say). To that is added the worst of
+# whatever it calls, all the way down - avr-libc and libgcc included, as they're in the disassembly too. An
+# indirect call (icall) is taken to be a call to the worst of the functions it could reach, given by indirect as
+# caller=callees rules, separated by semicolons: the first rule whose caller pattern matches the function making
+# the call gives the pattern for the functions it could call. An empty caller pattern matches any function.
+#
+# That gives the deepest chain from main(), and on top of it the deepest interrupt - interrupts don't nest here,
+# as every handler is a SIGNAL(). It prints each, then the total. With -v brief=1, it prints only the total.
+#
+# Recursion can't be bounded like this, so it's reported, and nothing is counted for going round again.
+
+BEGIN {
+	nrules = split(indirect, rule, ";")
+	for (i = 1; i <= nrules; i++) {
+		ruleCaller[i] = rule[i]
+		sub(/=.*$/, "", ruleCaller[i])
+		ruleCallees[i] = substr(rule[i], length(ruleCaller[i]) + 2)
+	}
+}
+
+function prologueOf(f) {
+	fn = f
+	frame[fn] = 2
+	ncalls[fn] = 0
+	inPrologue = 1
+	framing = 0
+	pending = 0
+}
+
+function depth(f,   i, c, d, worst) {
+	if (f in memo)
+		return memo[f]
+	if (f in active) {
+		recursive[f] = 1
+		return 0
+	}
+	active[f] = 1
+	worst = 0
+	for (i = 1; i <= ncalls[f]; i++) {
+		c = calls[f, i]
+		if (c == "*")
+			c = indirectWorst(f)
+		d = callArgs[f, i] + ((c == "") ? 0 : depth(c))
+		if (d > worst) {
+			worst = d
+			via[f] = c
+		}
+	}
+	delete active[f]
+	memo[f] = frame[f] + worst
+	return memo[f]
+}
+
+# The deepest of the functions that an indirect call from caller could reach.
+function indirectWorst(caller,   i, callees, f, d, worst, worstF) {
+	for (i = 1; i <= nrules; i++)
+		if (caller ~ ruleCaller[i]) {
+			callees = ruleCallees[i]
+			break
+		}
+	worst = -1
+	worstF = ""
+	if (callees != "")
+		for (f in frame)
+			if (f ~ callees) {
+				d = depth(f)
+				if (d > worst) {
+					worst = d
+					worstF = f
+				}
+			}
+	if (worstF == "")
+		unresolved[caller] = 1
+	return worstF
+}
+
+function chain(f,   total) {
+	total = depth(f)
+	for (; f != ""; f = via[f])
+		printf "  %5d %4d  %s\n", depth(f), frame[f], f
+	return total
+}
+
+# The start of a function, such as: 00000a2c <clockHandler(unsigned char, unsigned char)>:
+/^[0-9a-f]+ <.*>:$/ {
+	name = $0
+	sub(/^[0-9a-f]+ </, "", name)
+	sub(/>:$/, "", name)
+	prologueOf(name)
+	next
+}
+
+fn == "" { next }
+
+{
+	# The instruction and its operands, as in: "     a2c:	cf 93       	push	r28"
+	n = split($0, part, "\t")
+	if (n < 3)
+		next
+	op = part[3]
+	args = (n >= 4) ? part[4] : ""
+	target = ""
+	if (match($0, /; 0x[0-9a-f]+ <.*>$/)) {
+		target = substr($0, RSTART, RLENGTH)
+		sub(/^; 0x[0-9a-f]+ </, "", target)
+		sub(/>$/, "", target)
+	}
+}
+
+# The frame is set aside between reading SP into Y and writing it back, by "rcall .+0" (two bytes at a time),
+# or by taking it off Y.
+inPrologue && op == "in" && args ~ /^r28, 0x3d/ { framing = 1; next }
+inPrologue && op == "out" && args ~ /^0x3d, r28/ { framing = 0; inPrologue = 0; next }
+inPrologue && framing && op == "sbiw" && args ~ /^r28, / { frame[fn] += strtonum_(args); next }
+inPrologue && framing && op == "subi" && args ~ /^r28, / { low = strtonum_(args); next }
+inPrologue && framing && op == "sbci" && args ~ /^r29, / { high = strtonum_(args); if (high < 128) frame[fn] += low + 256 * high; next }
+inPrologue && op == "rcall" && args ~ /^\.\+0/ { frame[fn] += 2; next }
+inPrologue && op == "push" { frame[fn]++; next }
+inPrologue && (op == "in" || op == "out" || op == "eor" || op == "clr" || op == "cli") { next }
+inPrologue { inPrologue = 0 }
+
+op == "push" { pending++; next }
+op == "pop" { if (pending > 0) pending--; next }
+
+op == "icall" || op == "eicall" {
+	ncalls[fn]++
+	calls[fn, ncalls[fn]] = "*"
+	callArgs[fn, ncalls[fn]] = pending
+	next
+}
+
+# Calls, and jumps to other functions (tail calls - counting them as calls only overestimates).
+(op == "call" || op == "rcall" || op == "jmp" || op == "rjmp") && target != "" && target !~ /\+0x[0-9a-f]+$/ {
+	ncalls[fn]++
+	calls[fn, ncalls[fn]] = target
+	callArgs[fn, ncalls[fn]] = pending
+	next
+}
+
+# The last operand, in hex (awk has no strtonum everywhere).
+function strtonum_(s,   h, v, i) {
+	h = s
+	sub(/^.*0x/, "", h)
+	sub(/[^0-9a-fA-F].*$/, "", h)
+	v = 0
+	for (i = 1; i <= length(h); i++)
+		v = v * 16 + index("0123456789abcdef", tolower(substr(h, i, 1))) - 1
+	return v
+}
+
+END {
+	if (!("main" in frame)) {
+		print "stack: no main() in the disassembly" > "/dev/stderr"
+		exit 1
+	}
+
+	isrWorst = 0
+	for (f in frame)
+		if (f ~ /^__vector_[0-9]+$/ && depth(f) > isrWorst) {
+			isrWorst = depth(f)
+			isr = f
+		}
+	total = depth("main") + isrWorst
+
+	if (brief) {
+		print total
+		exit 0
+	}
+
+	print "Stack: deepest from main() (bytes so far, bytes in each function)"
+	chain("main")
+	if (isr != "") {
+		print "Stack: deepest interrupt, on top of that"
+		chain(isr)
+	}
+	for (f in recursive)
+		print "Stack: " f " is recursive - counted once"
+	for (f in unresolved)
+		print "Stack: " f " makes an indirect call to nothing in indirect - counted as nothing"
+	printf "Stack: %d bytes at most\n", total
+}